@@ -34,6 +34,7 @@ struct if_bcast {
     int fd;
     struct sockaddr_in addr;        /* Outbound address */
     struct sockaddr_in laddr;       /* local (bind) address */
+    struct rbatch *rbatch;          /* datagrams received */
 };
 
 /* Prevention of re-reading what has been written by a bi-directional interface
@@ -90,6 +91,8 @@ void *ifdup_bcast(void *ifb)
     /* unfortunately this will need changing and the new address binding. */
     (void) memcpy(&newif->laddr, &oldif->laddr, sizeof(oldif->laddr));
 
+    newif->rbatch = NULL;
+
     return((void *) newif);
 }
 
@@ -99,6 +102,9 @@ void cleanup_bcast(iface_t *ifa)
 
     close(ifb->fd);
 
+    if (ifb->rbatch)
+        free(ifb->rbatch);
+
     /* We could remove outgoing interfaces from the ignore list here, but
      * we'd have to check they weren't in use by some other interface */
 }
@@ -106,10 +112,12 @@ void cleanup_bcast(iface_t *ifa)
 void write_bcast(struct iface *ifa)
 {
     struct if_bcast *ifb;
-    senblk_t *sptr;
-    int data=0;
-    struct msghdr msgh;
-    struct iovec iov[2];
+    senblk_t *sv[WBATCH];
+    struct iovec tv[WBATCH];
+    struct iovec iov[2*WBATCH];
+    struct msghdr msgh,mv[WBATCH];
+    char *tbuf=NULL;
+    int i,n,err;
 
     ifb = (struct if_bcast *) ifa->info;
 
@@ -117,89 +125,81 @@ void write_bcast(struct iface *ifa)
     msgh.msg_namelen=sizeof(struct sockaddr_in);
     msgh.msg_control=NULL;
     msgh.msg_controllen=msgh.msg_flags=0;
-    msgh.msg_iov=iov;
-    msgh.msg_iovlen=1;
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*WBATCH)) == NULL) {
                 logerr(errno,"Disabing tag output on interface id %u (%s)",
                         ifa->id,(ifa->name)?ifa->name:"unlabelled");
                 ifa->tagflags=0;
-        } else {
-            msgh.msg_iovlen=2;
-            data=1;
         }
     }
 
     for (;;) {
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n = next_batch(ifa,sv,tv,&tbuf)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
+        for (i=0;i<n;i++) {
+            mv[i]=msgh;
+            mv[i].msg_iov=iov+2*i;
+            mv[i].msg_iovlen=0;
+            if (tv[i].iov_len)
+                iov[2*i+mv[i].msg_iovlen++]=tv[i];
+            iov[2*i+mv[i].msg_iovlen].iov_base=sv[i]->data;
+            iov[2*i+mv[i].msg_iovlen++].iov_len=sv[i]->len;
         }
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
-                ifa->tagflags=0;
-                msgh.msg_iovlen=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
+        err=send_msgs(ifb->fd,mv,n);
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
+        for (i=0;i<n;i++)
+            senblk_free(sv[i],ifa->q);
 
-        if ((sendmsg(ifb->fd,&msgh,0)) < 0)
+        if (err)
             break;
-
-        senblk_free(sptr,ifa->q);
     }
 
-    if (ifa->tagflags)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
 
-ssize_t read_bcast(struct iface *ifa, char *buf)
+/*
+ * Check whether a datagram comes from one of the addresses we're ignoring
+ * Args: unused, source address of datagram and its length
+ * Returns: 1 if the datagram should be dropped, 0 otherwise
+ */
+static int ignore_bcast(void *arg, struct sockaddr *src, socklen_t sz)
 {
-    struct if_bcast *ifb=(struct if_bcast *) ifa->info;
-    struct sockaddr_in src;
     struct ignore_addr *igp;
-    socklen_t sz = (socklen_t) sizeof(src);
-    ssize_t nread;
 
+    /* Probably superfluous check that we got the right size
+     * structure back */
+    if (sz != (socklen_t) sizeof(struct sockaddr_in))
+        return(1);
 
-    do {
-        nread = recvfrom(ifb->fd,buf,BUFSIZ,0,(struct sockaddr *) &src,&sz);
-        /* Probably superfluous check that we got the right size
-         * structure back */
-        if (sz != (socklen_t) sizeof(src)) {
-            sz = (socklen_t) sizeof(src);
-            continue;
-        }
-        /* Compare the source address to the list of interfaces we're
-         * ignoring */
+    /* Compare the source address to the list of interfaces we're
+     * ignoring */
 #if 0
-        pthread_rwlock_rdlock(&sysaddr_lock);
+    pthread_rwlock_rdlock(&sysaddr_lock);
 #endif
-        for (igp=ignore;igp;igp=igp->next) {
-            if (igp->iaddr.sin_addr.s_addr == src.sin_addr.s_addr)
-                break;
-        }
+    for (igp=ignore;igp;igp=igp->next) {
+        if (igp->iaddr.sin_addr.s_addr ==
+                ((struct sockaddr_in *) src)->sin_addr.s_addr)
+            break;
+    }
 #if 0
-        pthread_rwlock_unlock(&sysaddr_lock);
+    pthread_rwlock_unlock(&sysaddr_lock);
 #endif
-        /* If igp points to anything, we broke out of the above loop
-         * on a match. Drop the packet and carry on */
-        if (igp == NULL)
-            break;
-    } while (1);
-    return nread;
+    /* If igp points to anything, we broke out of the above loop
+     * on a match. Drop the packet and carry on */
+    return(igp != NULL);
+}
+
+ssize_t read_bcast(struct iface *ifa, char *buf)
+{
+    struct if_bcast *ifb=(struct if_bcast *) ifa->info;
+
+    return(recv_msgs(ifb->fd,&ifb->rbatch,buf,ignore_bcast,NULL));
 }
 
 struct iface *init_bcast(struct iface *ifa)
@@ -217,7 +217,7 @@ struct iface *init_bcast(struct iface *ifa)
     size_t qsize = DEFBCASTQSIZE;
     struct kopts *opt;
     
-    if ((ifb=malloc(sizeof(struct if_bcast))) == NULL) {
+    if ((ifb=calloc(1,sizeof(struct if_bcast))) == NULL) {
         logerr(errno,"Could not allocate memory");
         return(NULL);
     }
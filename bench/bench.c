@@ -0,0 +1,148 @@
+/* bench.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Common code for kplex's benchmarks.  Each runs over a corpus of sentences
+ * taken from a file of NMEA data (one sentence per line) if one is given,
+ * otherwise from a canned mix of navigation and AIS data, and reports the
+ * time per sentence and the rate at which sentence data were processed.
+ */
+
+#include "bench.h"
+
+/* A few seconds from a boat with a GPS, instruments and an AIS receiver */
+static const char *canned[] = {
+    "$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*6A\r\n",
+    "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n",
+    "$GPGSA,A,3,04,05,,09,12,,,24,,,,,2.5,1.3,2.1*39\r\n",
+    "$GPGSV,3,1,11,03,03,111,00,04,15,270,00,06,01,010,00,13,06,292,00*74\r\n",
+    "$GPVTG,054.7,T,034.4,M,005.5,N,010.2,K,A*25\r\n",
+    "$HCHDG,98.3,0.0,E,12.6,W*57\r\n",
+    "$IIMWV,214.8,R,0.1,K,A*36\r\n",
+    "$SDDBT,7.8,f,2.4,M,1.3,F*0D\r\n",
+    "$IIVHW,,T,,M,5.6,N,10.4,K*63\r\n",
+    "!AIVDM,1,1,,B,177KQJ5000G?tO`K>RA1wUbN0TKH,0*5C\r\n",
+    "!AIVDM,1,1,,A,13aEOK?P00PD2wVMdLDRhgvL289?,0*26\r\n",
+    "!AIVDM,1,1,,B,15N4cJ`005Jrek0H@9n`DW5608EP,0*13\r\n",
+    "!AIVDM,2,1,3,B,55P5TL01VIaAL@7WKO@mBplU@<PDhh000000001S;AJ::4A80?4i@E53,"
+            "0*3E\r\n",
+    "!AIVDM,2,2,3,B,1@0000000000000,2*55\r\n",
+    "!AIVDM,1,1,,A,B6CdCm0t3`tba35f@V9faHi7kP06,0*58\r\n",
+    "!AIVDO,1,1,,,B>qc:003wk?8mP=18D3Q3wgTiT;T,0*13\r\n",
+    NULL
+};
+
+/*
+ * Monotonic time in nanoseconds
+ */
+double now(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC,&ts);
+    return(ts.tv_sec*1e9+ts.tv_nsec);
+}
+
+/*
+ * Add a sentence to a corpus
+ * Args: pointer to corpus, sentence, its length including <CR><LF>
+ * Returns: 0 if added, -1 if it isn't a usable sentence or the corpus is full
+ */
+static int addsen(struct corpus *cp, const char *s, size_t len)
+{
+    if (cp->n >= MAXBENCHSEN || len < 7 || len > MAXSENMAX ||
+            (*s != '$' && *s != '!'))
+        return(-1);
+    if ((cp->sen[cp->n]=strndup(s,len)) == NULL) {
+        perror("strndup");
+        exit(1);
+    }
+    cp->len[cp->n++]=len;
+    cp->bytes+=len;
+    return(0);
+}
+
+/*
+ * Read sentences from a file, one per line.  Anything else is skipped
+ * Args: pointer to corpus, file name
+ * Returns: Nothing.  Exits if the file can't be read
+ */
+static void readsens(struct corpus *cp, const char *fname)
+{
+    FILE *f;
+    char line[BUFSIZ];
+    size_t len;
+
+    if ((f=fopen(fname,"r")) == NULL) {
+        perror(fname);
+        exit(1);
+    }
+    while (fgets(line,sizeof(line)-2,f) != NULL) {
+        len=strcspn(line,"\r\n");
+        memcpy(line+len,"\r\n",3);
+        (void) addsen(cp,line,len+2);
+    }
+    fclose(f);
+}
+
+/*
+ * Process the arguments common to the benchmarks: [sentences [file]]
+ * Args: argc and argv from main(), pointer to corpus to be filled in
+ * Returns: Number of passes to make over the corpus to process (about) the
+ * requested number of sentences.  Exits on error
+ */
+long bench_args(int argc, char **argv, struct corpus *cp)
+{
+    long count=DEFSENTENCES;
+    int i;
+
+    if (argc > 3 || (argc > 1 && (count=atol(argv[1])) <= 0)) {
+        fprintf(stderr,"Usage: %s [sentences [file]]\n",argv[0]);
+        exit(1);
+    }
+    memset(cp,0,sizeof(struct corpus));
+    if (argc > 2)
+        readsens(cp,argv[2]);
+    else
+        for (i=0;canned[i];i++)
+            (void) addsen(cp,canned[i],strlen(canned[i]));
+
+    if (cp->n == 0) {
+        fprintf(stderr,"No sentences to use\n");
+        exit(1);
+    }
+    return((count > cp->n)?count/cp->n:1);
+}
+
+/*
+ * Make a senblk holding a sentence from a corpus, as an input would
+ * Args: pointer to corpus, index of sentence, source id
+ * Returns: pointer to new pool senblk.  Exits on failure
+ */
+senblk_t *corpus_senblk(struct corpus *cp, int i, unsigned int src)
+{
+    senblk_t *sptr;
+
+    if ((sptr=senblk_alloc(cp->len[i])) == NULL) {
+        perror("senblk_alloc");
+        exit(1);
+    }
+    memcpy(sptr->data,cp->sen[i],cp->len[i]);
+    sptr->len=cp->len[i];
+    sptr->src=src;
+    senindex(sptr);
+    return(sptr);
+}
+
+/*
+ * Print a result line
+ * Args: what was timed, number of sentences, time taken (ns), bytes of
+ * data processed
+ * Returns: Nothing
+ */
+void bench_report(const char *what, long count, double ns, size_t bytes)
+{
+    printf("%-12s %10ld sentences %8.2f ns/sentence %8.1f MB/s\n",what,
+            count,ns/count,bytes/(ns/1e3));
+}
@@ -0,0 +1,27 @@
+/* bench.h
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Common code for kplex's benchmarks.  See bench.c
+ */
+
+#include "kplex.h"
+#include <time.h>
+
+/* Default number of sentences each benchmark processes */
+#define DEFSENTENCES 2000000
+#define MAXBENCHSEN 4096
+
+/* A set of sentences to run a benchmark over */
+struct corpus {
+    int n;                          /* number of sentences */
+    size_t bytes;                   /* total length of sentences */
+    char *sen[MAXBENCHSEN];         /* each sentence, <CR><LF> terminated */
+    size_t len[MAXBENCHSEN];
+};
+
+double now(void);
+long bench_args(int, char **, struct corpus *);
+senblk_t *corpus_senblk(struct corpus *, int, unsigned int);
+void bench_report(const char *, long, double, size_t);
@@ -0,0 +1,97 @@
+/* cksum.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Checksum benchmark.  Times verifying NMEA 0183 checksums:
+ *   bytewise:   the original one-char-at-a-time loop, kept here for reference
+ *   checkcksum: kplex's checkcksum(), summing a word at a time
+ *   fused:      checkcksum_xor(), given the sum do_read() accumulates while
+ *               framing, so only the checksum field itself is examined
+ * Results are in nanoseconds per sentence and megabytes of sentence data
+ * per second.
+ *
+ * Usage: cksum [sentences [file]]
+ */
+
+#include "bench.h"
+
+static senblk_t *sens[MAXBENCHSEN];
+static int xsums[MAXBENCHSEN];
+
+/*
+ * The checksum test as it was before it was done a word at a time
+ */
+static int bytewise(senblk_t *sptr)
+{
+    int cksm=0;
+    int rcvdcksum=0,i,end;
+    char *ptr;
+
+    for(i=0,end=sptr->len-6,ptr=sptr->data+1; i < end; ptr++,i++)
+            cksm ^= *ptr;
+
+    if (*ptr != '*')
+        return -1;
+
+    for (i=0,++ptr;i<2;i++,ptr++) {
+        if (*ptr>47 && *ptr<58)
+            rcvdcksum+=*ptr-48;
+        else if (*ptr>64 && *ptr<71)
+             rcvdcksum+=*ptr-55;
+        else if (*ptr>96 && *ptr<103)
+            rcvdcksum+=*ptr-87;
+        if (!i)
+            rcvdcksum<<=4;
+    }
+
+    return((cksm == rcvdcksum)?0:-1);
+}
+
+/*
+ * Time one way of checking the corpus
+ */
+static void bench(const char *what, int which, struct corpus *cp,
+        long passes)
+{
+    volatile int bad=0;
+    double start;
+    long p;
+    int i;
+
+    start=now();
+    for (p=0;p<passes;p++)
+        for (i=0;i<cp->n;i++)
+            switch (which) {
+            case 0:
+                bad+=bytewise(sens[i]);
+                break;
+            case 1:
+                bad+=checkcksum(sens[i]);
+                break;
+            default:
+                bad+=checkcksum_xor(sens[i],xsums[i]);
+            }
+    bench_report(what,passes*cp->n,now()-start,passes*cp->bytes);
+    if (bad)
+        printf("    (%d bad checksums)\n",-bad);
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus corpus;
+    long passes;
+    int i;
+
+    passes=bench_args(argc,argv,&corpus);
+    for (i=0;i<corpus.n;i++) {
+        sens[i]=corpus_senblk(&corpus,i,0);
+        /* What do_read() would have accumulated by the end of the sentence */
+        xsums[i]=calcsum(sens[i]->data+1,sens[i]->len-3);
+    }
+
+    bench("bytewise",0,&corpus,passes);
+    bench("checkcksum",1,&corpus,passes);
+    bench("fused",2,&corpus,passes);
+    exit(0);
+}
@@ -0,0 +1,130 @@
+/* filter.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Filter benchmark.  Times senfilter() applying rule sets like those found
+ * in real configurations:
+ *   none:     no filter, for reference
+ *   ifilter:  a short input filter dropping satellite data
+ *   ofilter:  a long output filter, most of whose rules deny types which
+ *             aren't present, followed by per-source accepts and "-all"
+ *   wildcard: rules with wildcards and sources
+ *   limit:    rate limiting rules
+ *   burst:    rate limiting rules for any source with bursts, so each
+ *             source has its own token bucket
+ *   failover: isactive() applying failover rules, with the preferred
+ *             source active
+ * Sentences are given one of three sources according to their talker.
+ * Results are in nanoseconds per sentence and megabytes of sentence data
+ * per second.
+ *
+ * Usage: filter [sentences [file]]
+ */
+
+#include "bench.h"
+
+#define GPSID (1<<IDMINORBITS)
+#define AISID (2<<IDMINORBITS)
+#define NMEAID (3<<IDMINORBITS)
+
+static struct {
+    char *what;
+    char *spec;
+} rulesets[] = {
+    { "none", NULL },
+    { "ifilter", "-GPGSV:-GPGSA:+all" },
+    { "ofilter", "-GPZDA:-GPGLL:-GPBOD:-GPRMB:-GPXTE:-GPAPB:-GPBWC:-GPWPL:"
+            "-GPRTE:-IIMTW:-IIVLW:-IIMWD:-IIXDR:-IIDPT:-IIRSA:-IIRPM:"
+            "-WIMDA:-WIMWV:-ERRPM:-YXXDR:-PGRME:-PGRMZ:-AIALR:-GPGSV:"
+            "+GPRMC%gps:+GPGGA%gps:+HCHDG:+IIMWV:+SDDBT:+IIVHW:"
+            "+AIVDM%ais:+AIVDO%ais:-all" },
+    { "wildcard", "-**GSV:-**GSA:+GP***%gps:+AI***%ais:+II***:+*****%nmea:"
+            "-all" },
+    { "limit", "~GPGSV/1:~AIVDM%ais/1:+all" },
+    { "burst", "~*****/0.1,10:+all" },
+    { NULL, NULL }
+};
+
+static senblk_t *sens[MAXBENCHSEN];
+
+/*
+ * Time a filter over the corpus
+ */
+static void bench(const char *what, char *spec, struct corpus *cp,
+        long passes)
+{
+    sfilter_t *filter=NULL;
+    volatile int passed=0;
+    double start;
+    long p;
+    int i;
+
+    if (spec && ((filter=getfilter(spec)) == NULL || name2id(filter) < 0)) {
+        fprintf(stderr,"Bad filter %s\n",spec);
+        exit(1);
+    }
+
+    start=now();
+    for (p=0;p<passes;p++)
+        for (i=0;i<cp->n;i++)
+            passed+=!senfilter(sens[i],filter);
+    bench_report(what,passes*cp->n,now()-start,passes*cp->bytes);
+    free_filter(filter);
+}
+
+/*
+ * Time failover rules over the corpus
+ */
+static void bench_failover(const char *what, struct corpus *cp, long passes)
+{
+    char spec1[]="GP***:0:gps:0.2:nmea";
+    char spec2[]="AI***:0:ais:1:nmea";
+    sfilter_t *filter=NULL;
+    volatile int passed=0;
+    double start;
+    long p;
+    int i;
+
+    if (addfailover(&filter,spec1) < 0 || addfailover(&filter,spec2) < 0 ||
+            name2id(filter) < 0) {
+        fprintf(stderr,"Bad failover\n");
+        exit(1);
+    }
+
+    start=now();
+    for (p=0;p<passes;p++)
+        for (i=0;i<cp->n;i++)
+            passed+=isactive(filter,sens[i]);
+    bench_report(what,passes*cp->n,now()-start,passes*cp->bytes);
+    free_filter(filter);
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus corpus;
+    unsigned int src;
+    long passes;
+    int i;
+
+    passes=bench_args(argc,argv,&corpus);
+    if (insertname("gps",GPSID) < 0 || insertname("ais",AISID) < 0 ||
+            insertname("nmea",NMEAID) < 0) {
+        fprintf(stderr,"Failed to add interface names\n");
+        exit(1);
+    }
+    for (i=0;i<corpus.n;i++) {
+        if (!strncmp(corpus.sen[i]+1,"GP",2))
+            src=GPSID;
+        else if (!strncmp(corpus.sen[i]+1,"AI",2))
+            src=AISID;
+        else
+            src=NMEAID;
+        sens[i]=corpus_senblk(&corpus,i,src);
+    }
+
+    for (i=0;rulesets[i].what;i++)
+        bench(rulesets[i].what,rulesets[i].spec,&corpus,passes);
+    bench_failover("failover",&corpus,passes);
+    exit(0);
+}
@@ -0,0 +1,126 @@
+/* frame.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Framing benchmark.  Times do_read() turning a stream of data into indexed
+ * senblks, as an input interface's thread does, with:
+ *   strict:   <CR><LF> terminated sentences required
+ *   loose:    any of <CR>, <LF> or NUL ending a sentence
+ *   checksum: checksums checked too
+ *   ifilter:  a typical input filter applied too
+ * The input dispatches directly to an engine with no outputs so that only
+ * the input's own work is timed.  Data are copied to do_read()'s buffer
+ * BUFSIZ bytes at a time, as a read() would.  Results are in nanoseconds per
+ * sentence and megabytes of input data per second.
+ *
+ * Usage: frame [sentences [file]]
+ */
+
+#include "bench.h"
+
+/* The corpus as one stream, and how much of it is left to read */
+static char *stream;
+static size_t streamlen,pos,left;
+
+/*
+ * readbuf routine for the benchmark input: copy the next part of the stream
+ */
+static ssize_t read_stream(iface_t *ifa, char *buf)
+{
+    size_t n,len;
+
+    for (len=0;len < BUFSIZ && left;len+=n,left-=n) {
+        n=streamlen-pos;
+        if (n > BUFSIZ-len)
+            n=BUFSIZ-len;
+        if (n > left)
+            n=left;
+        memcpy(buf+len,stream+pos,n);
+        if ((pos+=n) == streamlen)
+            pos=0;
+    }
+    return(len);
+}
+
+static void *read_thread(void *arg)
+{
+    do_read((iface_t *) arg);
+    return(NULL);
+}
+
+/*
+ * Time do_read() framing the corpus
+ * Args: what is being timed, number of passes over the corpus, corpus, the
+ * input's strict and checksum options, input filter specification or NULL
+ * and the engine it dispatches to
+ */
+static void bench(const char *what, long passes, struct corpus *cp,
+        int strict, int checksum, char *filter, iface_t *engine)
+{
+    iface_t ifa;
+    pthread_t tid;
+    double start;
+
+    memset(&ifa,0,sizeof(ifa));
+    ifa.name="bench";
+    ifa.id=1<<IDMINORBITS;
+    ifa.direction=IN;
+    ifa.lists=engine->lists;
+    ifa.readbuf=read_stream;
+    ifa.strict=strict;
+    ifa.checksum=checksum;
+    ifa.senmax=SENMAX;
+    if (init_q(&ifa,DEFQSIZE) < 0) {
+        perror("init_q");
+        exit(1);
+    }
+    if (filter && ((ifa.ifilter=getfilter(filter)) == NULL ||
+            name2id(ifa.ifilter) < 0)) {
+        fprintf(stderr,"Bad filter %s\n",filter);
+        exit(1);
+    }
+
+    pos=0;
+    left=passes*streamlen;
+    start=now();
+    pthread_create(&tid,NULL,read_thread,&ifa);
+    pthread_join(tid,NULL);
+    bench_report(what,passes*cp->n,now()-start,passes*cp->bytes);
+    free_filter(ifa.ifilter);
+    free_q(ifa.q);
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus corpus;
+    struct iolists lists;
+    struct if_engine e_info;
+    iface_t engine;
+    long passes;
+    char *ptr;
+    int i;
+
+    passes=bench_args(argc,argv,&corpus);
+    if ((stream=(char *) malloc(corpus.bytes)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (ptr=stream,i=0;i<corpus.n;ptr+=corpus.len[i++])
+        memcpy(ptr,corpus.sen[i],corpus.len[i]);
+    streamlen=corpus.bytes;
+
+    memset(&lists,0,sizeof(lists));
+    pthread_mutex_init(&lists.dispatch_mutex,NULL);
+    memset(&engine,0,sizeof(engine));
+    e_info.flags=K_DIRECT;
+    engine.info=&e_info;
+    engine.lists=&lists;
+    lists.engine=&engine;
+
+    bench("strict",passes,&corpus,1,0,NULL,&engine);
+    bench("loose",passes,&corpus,0,0,NULL,&engine);
+    bench("checksum",passes,&corpus,1,1,NULL,&engine);
+    bench("ifilter",passes,&corpus,1,0,"-GPGSV:-GPGSA:-AIVDO:+all",&engine);
+    exit(0);
+}
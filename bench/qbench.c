@@ -0,0 +1,307 @@
+/* qbench.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Queue benchmark.  Times sentences passing through kplex's ioqueues:
+ *   spsc:   the engine adding copies of sentences to one output queue
+ *   fanout: the engine adding references to each sentence to several output
+ *           queues, each drained by its own writer thread
+ *   mpsc:   several inputs adding sentences to the engine's queue
+ *   nxm:    several inputs adding sentences to the engine's queue and an
+ *           engine thread adding references to each to several outputs'
+ *           queues, as kplex does in its default dispatch mode
+ * Output queues use overflow=block so that the engine waits for slow
+ * writers rather than dropping.  The engine's queue can't, so the mpsc
+ * and nxm tests also report how many sentences were delivered.  Results are in
+ * nanoseconds per sentence added and sentences per second delivered to
+ * each consumer.
+ *
+ * Usage: qbench [sentences [outputs [inputs]]]
+ */
+
+#include "bench.h"
+
+#define DEFOUTPUTS 4
+#define DEFINPUTS 4
+#define BENCHQSIZE 4096
+
+struct consumer {
+    pthread_t tid;
+    ioqueue_t *q;
+    long count;
+};
+
+struct producer {
+    pthread_t tid;
+    ioqueue_t *q;
+    long count;
+};
+
+struct engine {
+    pthread_t tid;
+    ioqueue_t *q;
+    struct consumer *out;
+    int nout;
+};
+
+static const char *sentence="$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,"
+        "084.4,230394,003.1,W*6A\r\n";
+
+/*
+ * Create a queue as an output or the engine would
+ * Args: name, whether it is the engine's queue
+ * Returns: pointer to queue.  Exits on failure
+ */
+static ioqueue_t *mkq(char *name, int engine)
+{
+    iface_t ifa;
+
+    memset(&ifa,0,sizeof(ifa));
+    ifa.name=name;
+    ifa.qpolicy=Q_BLOCK;
+    ifa.qblock=60000;
+    if (((engine)?init_engine_q(&ifa,BENCHQSIZE):
+            init_q(&ifa,BENCHQSIZE)) < 0) {
+        perror("init_q");
+        exit(1);
+    }
+    return(ifa.q);
+}
+
+/*
+ * Drain a queue in batches as a writer would until it is shut down
+ */
+static void *consume(void *arg)
+{
+    struct consumer *c = (struct consumer *) arg;
+    senblk_t *sv[WBATCH];
+    int i,n;
+
+    while ((n=next_senblk_batch(c->q,sv,WBATCH)) > 0) {
+        c->count+=n;
+        for (i=0;i<n;i++)
+            senblk_free(sv[i],c->q);
+    }
+    return(NULL);
+}
+
+/*
+ * Pass references to sentences on the engine's queue to each output's queue
+ * as the engine would until the engine's queue is shut down
+ */
+static void *fan_out(void *arg)
+{
+    struct engine *e = (struct engine *) arg;
+    senblk_t *sv[WBATCH];
+    int i,j,n;
+
+    while ((n=next_senblk_batch(e->q,sv,WBATCH)) > 0)
+        for (i=0;i<n;i++) {
+            for (j=0;j<e->nout;j++)
+                push_senblk_ref(sv[i],e->out[j].q);
+            senblk_free(sv[i],e->q);
+        }
+    return(NULL);
+}
+
+/*
+ * Add copies of a sentence to a queue as an input would
+ */
+static void *produce(void *arg)
+{
+    struct producer *p = (struct producer *) arg;
+    senblk_t *sptr;
+    long i;
+
+    if ((sptr=senblk_alloc(strlen(sentence))) == NULL) {
+        perror("senblk_alloc");
+        exit(1);
+    }
+    sptr->len=strlen(sentence);
+    sptr->src=1<<IDMINORBITS;
+    memcpy(sptr->data,sentence,sptr->len);
+    for (i=0;i<p->count;i++)
+        push_senblk(sptr,p->q);
+    senblk_release(sptr);
+    return(NULL);
+}
+
+/*
+ * Print a result line
+ */
+static void report(const char *what, long added, long got, long expected,
+        double ns, int consumers)
+{
+    printf("%-8s %10ld sentences %8.1f ns/sentence %6.2f M/s per consumer",
+            what,added,ns/added,got/consumers/(ns/1e3));
+    if (got != expected)
+        printf(" (%.1f%% delivered)",got*100.0/expected);
+    putchar('\n');
+}
+
+/*
+ * One producer (this thread) copying sentences to a single output queue
+ */
+static void bench_spsc(long count)
+{
+    struct consumer c;
+    struct producer p;
+    double start;
+
+    c.q=p.q=mkq("spsc",0);
+    c.count=0;
+    p.count=count;
+    start=now();
+    pthread_create(&c.tid,NULL,consume,&c);
+    produce(&p);
+    push_senblk(NULL,c.q);
+    pthread_join(c.tid,NULL);
+    report("spsc",count,c.count,count,now()-start,1);
+    free_q(c.q);
+}
+
+/*
+ * One producer (this thread) adding references to every sentence to
+ * several output queues
+ */
+static void bench_fanout(long count, int nout)
+{
+    struct consumer *c;
+    senblk_t *sptr;
+    double start;
+    long i,got=0;
+    int j;
+
+    if ((c=(struct consumer *) calloc(nout,sizeof(struct consumer))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (j=0;j<nout;j++)
+        c[j].q=mkq("fanout",0);
+
+    start=now();
+    for (j=0;j<nout;j++)
+        pthread_create(&c[j].tid,NULL,consume,&c[j]);
+    for (i=0;i<count;i++) {
+        if ((sptr=senblk_alloc(strlen(sentence))) == NULL) {
+            perror("senblk_alloc");
+            exit(1);
+        }
+        sptr->len=strlen(sentence);
+        sptr->src=1<<IDMINORBITS;
+        memcpy(sptr->data,sentence,sptr->len);
+        for (j=0;j<nout;j++)
+            push_senblk_ref(sptr,c[j].q);
+        senblk_release(sptr);
+    }
+    for (j=0;j<nout;j++) {
+        push_senblk(NULL,c[j].q);
+        pthread_join(c[j].tid,NULL);
+        got+=c[j].count;
+        free_q(c[j].q);
+    }
+    report("fanout",count,got,count*nout,now()-start,nout);
+    free(c);
+}
+
+/*
+ * Several producers adding sentences to the engine's queue
+ */
+static void bench_mpsc(long count, int nin)
+{
+    struct producer *p;
+    struct consumer c;
+    double start;
+    int j;
+
+    if ((p=(struct producer *) calloc(nin,sizeof(struct producer))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    c.q=mkq("engine",1);
+    c.count=0;
+    start=now();
+    pthread_create(&c.tid,NULL,consume,&c);
+    for (j=0;j<nin;j++) {
+        p[j].q=c.q;
+        p[j].count=count/nin;
+        pthread_create(&p[j].tid,NULL,produce,&p[j]);
+    }
+    for (j=0;j<nin;j++)
+        pthread_join(p[j].tid,NULL);
+    push_senblk(NULL,c.q);
+    pthread_join(c.tid,NULL);
+    report("mpsc",count/nin*nin,c.count,count/nin*nin,now()-start,1);
+    free_q(c.q);
+    free(p);
+}
+
+/*
+ * Several producers adding sentences to the engine's queue and the engine
+ * adding references to them to several output queues
+ */
+static void bench_nxm(long count, int nin, int nout)
+{
+    struct producer *p;
+    struct engine e;
+    double start;
+    long added=count/nin*nin,got=0;
+    int j;
+
+    if ((p=(struct producer *) calloc(nin,sizeof(struct producer))) == NULL ||
+            (e.out=(struct consumer *) calloc(nout,sizeof(struct consumer)))
+            == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    e.q=mkq("engine",1);
+    e.nout=nout;
+    for (j=0;j<nout;j++)
+        e.out[j].q=mkq("nxm",0);
+
+    start=now();
+    for (j=0;j<nout;j++)
+        pthread_create(&e.out[j].tid,NULL,consume,&e.out[j]);
+    pthread_create(&e.tid,NULL,fan_out,&e);
+    for (j=0;j<nin;j++) {
+        p[j].q=e.q;
+        p[j].count=count/nin;
+        pthread_create(&p[j].tid,NULL,produce,&p[j]);
+    }
+    for (j=0;j<nin;j++)
+        pthread_join(p[j].tid,NULL);
+    push_senblk(NULL,e.q);
+    pthread_join(e.tid,NULL);
+    for (j=0;j<nout;j++) {
+        push_senblk(NULL,e.out[j].q);
+        pthread_join(e.out[j].tid,NULL);
+        got+=e.out[j].count;
+        free_q(e.out[j].q);
+    }
+    report("nxm",added,got,added*nout,now()-start,nout);
+    free_q(e.q);
+    free(e.out);
+    free(p);
+}
+
+int main(int argc, char **argv)
+{
+    long count=DEFSENTENCES;
+    int nout=DEFOUTPUTS,nin=DEFINPUTS;
+
+    if (argc > 1 && (count=atol(argv[1])) <= 0) {
+        fprintf(stderr,"Usage: %s [sentences [outputs [inputs]]]\n",argv[0]);
+        exit(1);
+    }
+    if (argc > 2 && (nout=atoi(argv[2])) <= 0)
+        nout=DEFOUTPUTS;
+    if (argc > 3 && (nin=atoi(argv[3])) <= 0)
+        nin=DEFINPUTS;
+
+    bench_spsc(count);
+    bench_fanout(count,nout);
+    bench_mpsc(count,nin);
+    bench_nxm(count,nin,nout);
+    exit(0);
+}
@@ -0,0 +1,79 @@
+/* tag.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * TAG block benchmark.  Times gettag() making the NMEA 0183 v4 TAG block an
+ * output sends ahead of each sentence, with the output's "timestamp" and
+ * "srctag" options set as follows:
+ *   s:        srctag set (the output's own name)
+ *   isrc:     srctag=input (the name of the input the sentence came from)
+ *   c:        timestamp=s
+ *   c:ms      timestamp=ms
+ *   s:,c:ms   srctag set and timestamp=ms
+ * Results are in nanoseconds per sentence and megabytes of TAG block
+ * generated per second.
+ *
+ * Usage: tag [sentences [file]]
+ */
+
+#include "bench.h"
+
+#define SRCID (1<<IDMINORBITS)
+
+static struct {
+    char *what;
+    int flags;
+} variants[] = {
+    { "s:", TAG_SRC },
+    { "isrc", TAG_SRC|TAG_ISRC },
+    { "c:", TAG_TS },
+    { "c:ms", TAG_TS|TAG_MS },
+    { "s:,c:ms", TAG_SRC|TAG_TS|TAG_MS },
+    { NULL, 0 }
+};
+
+static senblk_t *sens[MAXBENCHSEN];
+
+/*
+ * Time making tags for the corpus
+ */
+static void bench(const char *what, int flags, struct corpus *cp,
+        long passes)
+{
+    char buf[TAGMAX];
+    iface_t ifa;
+    size_t bytes=0;
+    double start;
+    long p;
+    int i;
+
+    memset(&ifa,0,sizeof(ifa));
+    ifa.name="output";
+    ifa.tagflags=flags;
+
+    start=now();
+    for (p=0;p<passes;p++)
+        for (i=0;i<cp->n;i++)
+            bytes+=gettag(&ifa,buf,sens[i]);
+    bench_report(what,passes*cp->n,now()-start,bytes);
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus corpus;
+    long passes;
+    int i;
+
+    passes=bench_args(argc,argv,&corpus);
+    if (insertname("gps",SRCID) < 0) {
+        fprintf(stderr,"Failed to add interface name\n");
+        exit(1);
+    }
+    for (i=0;i<corpus.n;i++)
+        sens[i]=corpus_senblk(&corpus,i,SRCID);
+
+    for (i=0;variants[i].what;i++)
+        bench(variants[i].what,variants[i].flags,&corpus,passes);
+    exit(0);
+}
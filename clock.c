@@ -0,0 +1,87 @@
+/* clock.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Clocks for code which runs for every sentence: rate limits, failover and
+ * TAG block timestamps.
+ *
+ * Intervals are measured with a monotonic clock so that they aren't upset
+ * when the wall clock is stepped.  Where available the "coarse" clocks are
+ * used.  These are only as precise as the kernel's tick (a few ms) but are
+ * read from memory shared with the kernel without a system call.
+ *
+ * TAG block timestamps have to be wall clock time.  Each thread keeps the
+ * digits of the last second it formatted, so a timestamp is a copy of those
+ * and, at most, three more digits for the milliseconds
+ */
+
+#include "kplex.h"
+#include <time.h>
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define MONOCLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define MONOCLOCK CLOCK_MONOTONIC
+#endif
+
+#ifdef CLOCK_REALTIME_COARSE
+#define WALLCLOCK CLOCK_REALTIME_COARSE
+#else
+#define WALLCLOCK CLOCK_REALTIME
+#endif
+
+/* Length of a TAG block timestamp in seconds */
+#define TAGSECS 10
+
+/* This thread's last formatted second */
+static _Thread_local time_t tagsec = -1;
+static _Thread_local char tagdigits[TAGSECS];
+
+/*
+ * Read the monotonic clock
+ * Args: None
+ * Returns: Milliseconds since some unspecified point in the past
+ */
+uint64_t mono_ms(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(MONOCLOCK,&ts);
+    return((uint64_t) ts.tv_sec*1000+ts.tv_nsec/1000000);
+}
+
+/*
+ * Write the current time as the value of a TAG block "c:" parameter
+ * Args: Buffer to write to (not terminated), whether to include
+ * milliseconds
+ * Returns: Number of characters written: TAGSECS, or TAGSECS+3 with
+ * milliseconds
+ * Milliseconds need the precise wall clock.  Seconds alone make do with the
+ * coarse one
+ */
+size_t tagtime(char *buf, int ms)
+{
+    struct timespec ts;
+    unsigned int n;
+    time_t t;
+    int i;
+
+    (void) clock_gettime((ms)?CLOCK_REALTIME:WALLCLOCK,&ts);
+
+    if (ts.tv_sec != tagsec) {
+        tagsec=ts.tv_sec;
+        for (t=tagsec,i=TAGSECS-1;i >= 0;i--,t/=10)
+            tagdigits[i]='0'+t%10;
+    }
+    memcpy(buf,tagdigits,TAGSECS);
+
+    if (!ms)
+        return(TAGSECS);
+
+    n=ts.tv_nsec/1000000;
+    buf[TAGSECS]='0'+n/100;
+    buf[TAGSECS+1]='0'+n/10%10;
+    buf[TAGSECS+2]='0'+n%10;
+    return(TAGSECS+3);
+}
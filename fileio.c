@@ -54,11 +54,12 @@ void cleanup_file(iface_t *ifa)
 void write_file(iface_t *ifa)
 {
     struct if_file *ifc = (struct if_file *) ifa->info;
-    senblk_t *sptr;
+    senblk_t *sv[WBATCH];
+    struct iovec tv[WBATCH];
+    struct iovec iov[3*WBATCH];
     int usereturn=flag_test(ifa,F_NOCR)?0:1;
-    int data=0;
-    int cnt=1;
-    struct iovec iov[2];
+    int i,n,cnt,err;
+    char *tbuf=NULL;
 
     /* ifc->fd will only be < 0 if we're opening a FIFO.
      */
@@ -71,47 +72,46 @@ void write_file(iface_t *ifa)
             logerr(errno,"Could not create queue for FIFO %s",ifc->filename);
             iface_thread_exit(errno);
         }
+        pthread_mutex_lock(&ifa->lists->io_mutex);
+        (void) publish_outputs(ifa->lists);
+        pthread_mutex_unlock(&ifa->lists->io_mutex);
         DEBUG(3,"%s opened FIFO %s for writing",ifa->name,ifc->filename);
     }
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*WBATCH)) == NULL) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
                 ifa->tagflags=0;
-        } else {
-            cnt=2;
-            data=1;
         }
     }
 
 
     for(;;)  {
-        if ((sptr = next_senblk(ifa->q)) == NULL) {
+        if ((n = next_batch(ifa,sv,tv,&tbuf)) == 0) {
             break;
         }
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
+        for (i=cnt=0;i<n;i++) {
+            if (tv[i].iov_len)
+                iov[cnt++]=tv[i];
+            iov[cnt].iov_base=sv[i]->data;
+            iov[cnt++].iov_len=sv[i]->len;
+            /* senblks may be shared with other outputs so rather than
+             * changing the sentence's CR-LF in place, write it without and
+             * add the LF */
+            if (!usereturn) {
+                iov[cnt-1].iov_len-=2;
+                iov[cnt].iov_base="\n";
+                iov[cnt++].iov_len=1;
+            }
         }
 
-        if (!usereturn) {
-            sptr->data[sptr->len-2] = '\n';
-            sptr->len--;
-        }
+        err=writev_all(ifc->fd,iov,cnt);
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"%s: Disabing tag output",ifa->name);
-                ifa->tagflags=0;
-                cnt=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
+        for (i=0;i<n;i++)
+            senblk_free(sv[i],ifa->q);
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-        if (writev(ifc->fd,iov,cnt) <0) {
+        if (err) {
             if (!(flag_test(ifa,F_PERSIST) && errno == EPIPE) ) {
                 logerr(errno,"%s: write failed",ifa->name);
                 break;
@@ -124,11 +124,10 @@ void write_file(iface_t *ifa)
             }
             DEBUG(4,"%s: reconnected to FIFO %s",ifa->name,ifc->filename);
         }
-        senblk_free(sptr,ifa->q);
     }
 
-    if (cnt == 2)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
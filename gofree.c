@@ -100,14 +100,41 @@ iface_t *new_gofree_conn(pthread_t *tid, struct gofree_mfd *mfd, iface_t *ifa)
     newifa->ifilter=addfilter(ifa->ifilter);
     /* Copying ofilter is unnecessary as gofree is input only */
     newifa->checksum=ifa->checksum;
-    newifa->q=ifa->lists->engine->q;
+    newifa->weight=ifa->weight;
+    newifa->senmax=ifa->senmax;
+    newifa->sched=ifa->sched;
+    if (attach_input(newifa) < 0) {
+        err=errno;
+        close(newift->fd);
+        free_filter(newifa->ifilter);
+        free(newift);
+        free(newifa);
+        errno=err;
+        return(NULL);
+    }
     /* disable SIGUSR1 before launching new thread to avoid it being killed
      * while holding a mutex */
     sigemptyset(&set);
     sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &set, &saved);
     link_to_initialized(newifa);
-    pthread_create(tid,NULL,(void *)start_interface,(void *) newifa);
+    if ((err=thread_create(tid,&newifa->sched,(void *)start_interface,
+            (void *) newifa)) != 0) {
+        logerr(err,"Failed to start connection to MFD %s",mfd->name);
+        pthread_mutex_lock(&ifa->lists->io_mutex);
+        unlink_initialized(newifa);
+        pthread_mutex_unlock(&ifa->lists->io_mutex);
+        pthread_sigmask(SIG_SETMASK,&saved,NULL);
+        close(newift->fd);
+        /* An input's queue is its own only in fair dispatch mode */
+        if (newifa->q && newifa->q->notify)
+            free_q(newifa->q);
+        free_filter(newifa->ifilter);
+        free(newift);
+        free(newifa);
+        errno=err;
+        return(NULL);
+    }
 
     /* reset sig mask and re-enable SIGUSR1 */
     pthread_sigmask(SIG_SETMASK,&saved,NULL);
@@ -10,6 +10,10 @@
  * defined in interface-specific files
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* for pthread_attr_setaffinity_np() */
+#endif
+
 #include "kplex.h"
 #include "kplex_mods.h"
 #include "version.h"
@@ -21,8 +25,24 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <limits.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Bytes an input's deficit is credited with per unit of weight on each round
+ * of fair dispatching.  See run_engine() */
+#define DRRQUANTUM SENMAX
+/* Filters with fewer rules than this are quicker to try rule by rule than
+ * to look up in a compiled filter */
+#define FILTERINDEXMIN 8
+/* Size of a cache entry for a snapshot of the output list */
+#define SUBENTSZ(snap) (sizeof(struct subent)+(snap)->words*sizeof(uint64_t))
 
 /* Macro to identify kplex Proprietary sentences */
 #define isprop(sptr) (sptr->len >= 7 && sptr->data[1] == 'P' && sptr->data[2] == 'K' && sptr->data[3] == 'P' && sptr->data[4] == 'X')
@@ -33,6 +53,7 @@ pthread_t reaper;       /* tid of thread responsible for reaping */
 int timetodie=0;        /* Set on receipt of SIGTERM or SIGINT */
 time_t graceperiod=3;   /* Grace period for unsent data before shutdown (secs)*/
 int debuglevel=0;                    /* debug off by default */
+size_t thrstack=0;      /* Thread stack size, 0 for the default */
 
 /* Signal handler for SIGUSR1 used by interface threads.  Note that this is
  * highly dubious: pthread_exit() is not async safe.  No associated problems
@@ -60,6 +81,28 @@ int mysleep(time_t sleepytime)
 
 /* functions */
 
+/*
+ * Convert the two hex digits of a checksum field
+ * Args: pointer to the first digit
+ * Returns: value of the digits.  Characters which aren't hex digits count as 0
+ */
+static int hexsum(const char *ptr)
+{
+    int i,rcvdcksum=0;
+
+    for (i=0;i<2;i++,ptr++) {
+        if (*ptr>47 && *ptr<58)
+            rcvdcksum+=*ptr-48;
+        else if (*ptr>64 && *ptr<71)
+             rcvdcksum+=*ptr-55;
+        else if (*ptr>96 && *ptr<103)
+            rcvdcksum+=*ptr-87;
+        if (!i)
+            rcvdcksum<<=4;
+    }
+    return(rcvdcksum);
+}
+
 /*
  * Check an NMEA 0183 checksum
  * Args: pointer to struct senblk
@@ -68,31 +111,414 @@ int mysleep(time_t sleepytime)
  */
 int checkcksum (senblk_t *sptr)
 {
-    int cksm=0;
-    int rcvdcksum=0,i,end;
+    int end=sptr->len-6;
+    char *ptr=sptr->data+1;
+
+    if (end < 0)
+        end=0;
+    ptr+=end;
+
+    if (*ptr != '*')
+        return -1;
+
+    return((calcsum(sptr->data+1,end) == hexsum(ptr+1))?0:-1);
+}
+
+/*
+ * Check an NMEA 0183 checksum given the checksum of everything after the
+ * start character up to the end of the checksum field, as accumulated by
+ * do_read() while framing the sentence.  Saves a second pass over the data
+ * Args: pointer to struct senblk, checksum of data[1] to data[len-3]
+ * Returns: 0 if checksum matches checksum field, -1 otherwise
+ */
+int checkcksum_xor (senblk_t *sptr, int xsum)
+{
     char *ptr;
 
-    for(i=0,end=sptr->len-6,ptr=sptr->data+1; i < end; ptr++,i++)
-            cksm ^= *ptr;
+    if (sptr->len < 7)
+        return(checkcksum(sptr));
 
+    ptr=sptr->data+sptr->len-5;
     if (*ptr != '*')
         return -1;
 
-    for (i=0,++ptr;i<2;i++,ptr++) {
-        if (*ptr>47 && *ptr<58)
-            rcvdcksum+=*ptr-48;
-        else if (*ptr>64 && *ptr<71)
-             rcvdcksum+=*ptr-55;
-        else if (*ptr>96 && *ptr<103)
-            rcvdcksum+=*ptr-87;
-        if (!i)
-            rcvdcksum<<=4;
+    /* Take the '*' and checksum digits back out */
+    return(((xsum^ptr[0]^ptr[1]^ptr[2]) == hexsum(ptr+1))?0:-1);
+}
+
+/*
+ * Record the offsets of the commas in part of a sentence being indexed
+ * Args: pointer to senblk, start and end of the part of its data to search
+ * Returns: Nothing
+ */
+static void index_fields(senblk_t *sptr, const char *cptr, const char *eptr)
+{
+    int n;
+
+    for (;(cptr=memchr(cptr,',',eptr-cptr)) != NULL;cptr++)
+        if ((n=sptr->nfields++) < MAXFIELDIDX)
+            sptr->sep[n]=(cptr-sptr->data <= UCHAR_MAX)?cptr-sptr->data:0;
+}
+
+/*
+ * Finish indexing a sentence once all its commas have been recorded: find
+ * the end of the last field and work out the type code
+ * Args: pointer to senblk
+ * Returns: Nothing
+ */
+static void index_end(senblk_t *sptr)
+{
+    const char *cptr,*eptr=sptr->data+sptr->len-2;
+    uint64_t type;
+    int i,n;
+
+    /* The last field runs up to the checksum, if there is one */
+    if ((n=sptr->nfields++) < MAXFIELDIDX) {
+        if (n == 0 || sptr->sep[n-1]) {
+            cptr=sptr->data+((n)?sptr->sep[n-1]+1:1);
+            if ((cptr=memchr(cptr,'*',eptr-cptr)) == NULL)
+                cptr=eptr;
+            sptr->sep[n]=(cptr-sptr->data <= UCHAR_MAX)?cptr-sptr->data:0;
+        } else
+            sptr->sep[n]=0;
     }
 
-    if (cksm == rcvdcksum)
-        return (0);
-    else
+    if (sptr->len > 7) {
+        for (type=0,i=5;i;i--)
+            type=(type<<8)|(unsigned char) sptr->data[i];
+    } else {
+        /* Whatever follows the sentence in the senblk isn't part of it */
+        for (type=0,i=sptr->len-3;i > 0;i--)
+            type=(type<<8)|(unsigned char) sptr->data[i];
+        type|=TYPE_SHORT;
+    }
+    if (*sptr->data == '\r')
+        type|=TYPE_EMPTY;
+    sptr->type=type;
+}
+
+/*
+ * Index the fields of a sentence and work out its type code
+ * Args: pointer to senblk containing a complete sentence
+ * Returns: Nothing
+ * do_read() indexes sentences as it frames them.  Anything else putting a
+ * sentence in a senblk must call this before queuing it
+ */
+void senindex(senblk_t *sptr)
+{
+    sptr->nfields=0;
+    index_fields(sptr,sptr->data+1,sptr->data+sptr->len-2);
+    index_end(sptr);
+}
+
+/*
+ * Find a field of an indexed sentence
+ * Args: pointer to senblk, field number (0 for the address field), pointer
+ * to field length to be filled in
+ * Returns: pointer to start of field, NULL if the sentence doesn't have
+ * that many fields
+ */
+char *senfield(senblk_t *sptr, int n, size_t *len)
+{
+    char *cptr,*fptr,*eptr;
+    int i;
+
+    if (n >= sptr->nfields)
+        return(NULL);
+
+    if (n < MAXFIELDIDX && sptr->sep[n]) {
+        cptr=sptr->data+((n)?sptr->sep[n-1]+1:1);
+        *len=sptr->data+sptr->sep[n]-cptr;
+        return(cptr);
+    }
+
+    /* Beyond the index: carry on from the last field it covers */
+    for (i=(n < MAXFIELDIDX)?n:MAXFIELDIDX;i && sptr->sep[i-1] == 0;i--);
+    eptr=sptr->data+sptr->len-2;
+    cptr=sptr->data+((i)?sptr->sep[i-1]+1:1);
+    for (;i<n;i++)
+        cptr=(char *) memchr(cptr,',',eptr-cptr)+1;
+    if ((fptr=memchr(cptr,',',eptr-cptr)) == NULL &&
+            (fptr=memchr(cptr,'*',eptr-cptr)) == NULL)
+        fptr=eptr;
+    *len=fptr-cptr;
+    return(cptr);
+}
+
+/*
+ * Set the type code mask and value which match a filter or failover rule's
+ * sentence type
+ * Args: pointer to rule with match filled in
+ * Returns: Nothing
+ */
+void rule_type(sf_rule_t *rule)
+{
+    int i;
+
+    for (rule->tmask=rule->tval=0,i=4;i >= 0;i--) {
+        rule->tmask<<=8;
+        rule->tval<<=8;
+        if (rule->match[i]) {
+            rule->tmask|=0xff;
+            rule->tval|=(unsigned char) rule->match[i];
+        }
+    }
+}
+
+/*
+ * Hash a compiled filter table key
+ * Args: class, type code value, source id
+ * Returns: hash
+ */
+static inline size_t fhash(int cls, uint64_t val, uint32_t src)
+{
+    return((size_t) (((val ^ ((uint64_t) src << 24) ^ cls) *
+            UINT64_C(0x9e3779b97f4a7c15)) >> 32));
+}
+
+/*
+ * Look up a rule in a compiled filter
+ * Args: pointer to compiled filter, class, type code value, source id
+ * Returns: pointer to table entry for the first rule with that key, NULL
+ * if there is none
+ */
+static inline struct fentry *flookup(struct fcompiled *fc, int cls,
+        uint64_t val, uint32_t src)
+{
+    struct fentry *e;
+    size_t i;
+
+    for (i=fhash(cls,val,src)&fc->mask;(e=&fc->ent[i])->cls >= 0;
+            i=(i+1)&fc->mask)
+        if (e->cls == cls && e->val == val && e->src == src)
+            return(e);
+    return(NULL);
+}
+
+/*
+ * Index a filter's rules so that findrule() can find the first rule
+ * matching a sentence without trying every rule in turn.  Rules are grouped
+ * into classes by which characters of their match strings are wildcards.
+ * Within a class a sentence can only match rules whose type code values
+ * equal its own masked with the class's mask, so each class needs at most
+ * two lookups of a hash table: one for rules for the sentence's source and
+ * one for rules for any source.  Filters with only a few rules are left
+ * for findrule() to try in turn
+ * Args: pointer to filter.  Any existing index is replaced
+ * Returns: 0 on success, -1 on failure
+ * Must be done again if rules' source ids are changed
+ */
+int compile_filter(sfilter_t *filter)
+{
+    struct fcompiled *fc;
+    struct fentry *e;
+    sf_rule_t *rptr;
+    size_t size,i;
+    int c,n;
+
+    if (filter->comp) {
+        free(filter->comp);
+        filter->comp=NULL;
+    }
+
+    for (n=0,filter->limits=0,rptr=filter->rules;rptr;rptr=rptr->next,n++)
+        if (rptr->type == LIMIT)
+            filter->limits++;
+    if (n < FILTERINDEXMIN)
+        return(0);
+    for (size=8;size < 2*n;size<<=1);
+
+    if ((fc=(struct fcompiled *) malloc(sizeof(struct fcompiled)+
+            size*sizeof(struct fentry))) == NULL) {
+        logerr(errno,"Failed to allocate memory for filter");
         return(-1);
+    }
+    fc->ncls=0;
+    fc->mask=size-1;
+    for (i=0;i<size;i++)
+        fc->ent[i].cls=-1;
+
+    for (n=0,rptr=filter->rules;rptr;rptr=rptr->next,n++) {
+        for (c=0;c < fc->ncls && fc->cls[c].mask != rptr->tmask;c++);
+        if (c == fc->ncls) {
+            fc->cls[c].mask=rptr->tmask;
+            fc->cls[c].first=n;
+            fc->cls[c].any=fc->cls[c].bysrc=0;
+            fc->ncls++;
+        }
+        if (rptr->src.id)
+            fc->cls[c].bysrc=1;
+        else
+            fc->cls[c].any=1;
+        /* An earlier rule with the same key always fires first */
+        if (flookup(fc,c,rptr->tval,rptr->src.id))
+            continue;
+        for (i=fhash(c,rptr->tval,rptr->src.id)&fc->mask;
+                fc->ent[i].cls >= 0;i=(i+1)&fc->mask);
+        e=&fc->ent[i];
+        e->val=rptr->tval;
+        e->src=rptr->src.id;
+        e->cls=c;
+        e->n=n;
+        e->rule=rptr;
+    }
+
+    filter->comp=fc;
+    return(0);
+}
+
+/*
+ * Find the first rule in a filter which matches a sentence
+ * Args: pointer to filter, sentence's type code, sentence's source id with
+ * the minor part masked off
+ * Returns: pointer to rule, NULL if no rule matches
+ */
+static inline sf_rule_t *findrule(sfilter_t *filter, uint64_t type,
+        uint32_t src)
+{
+    struct fcompiled *fc;
+    struct fentry *e,*best=NULL;
+    sf_rule_t *fptr;
+    uint64_t val;
+    int c;
+
+    if ((fc=filter->comp) == NULL) {
+        for (fptr=filter->rules;fptr;fptr=fptr->next)
+            if ((!fptr->src.id || fptr->src.id == src) &&
+                    (type & fptr->tmask) == fptr->tval)
+                break;
+        return(fptr);
+    }
+
+    /* Classes are in order of their first rules, so once a match has
+     * been found classes starting after it can't have an earlier one */
+    for (c=0;c < fc->ncls && (best == NULL || fc->cls[c].first < best->n);
+            c++) {
+        val=type & fc->cls[c].mask;
+        if (fc->cls[c].any && (e=flookup(fc,c,val,0)) &&
+                (best == NULL || e->n < best->n))
+            best=e;
+        if (fc->cls[c].bysrc && src && (e=flookup(fc,c,val,src)) &&
+                (best == NULL || e->n < best->n))
+            best=e;
+    }
+    return((best)?best->rule:NULL);
+}
+
+static pthread_once_t lbucket_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lbucket_key;
+
+static void lbucket_init(void)
+{
+    (void) pthread_key_create(&lbucket_key,free);
+}
+
+/*
+ * Hash a rate limit bucket key
+ * Args: LIMIT rule's generation, source id
+ * Returns: hash
+ */
+static inline size_t lhash(uint64_t gen, uint32_t src)
+{
+    return((size_t) (((gen << 32 ^ gen ^ src) *
+            UINT64_C(0x9e3779b97f4a7c15)) >> 32));
+}
+
+/*
+ * Find or add this thread's bucket for a LIMIT rule and source
+ * Args: LIMIT rule, source id
+ * Returns: pointer to bucket, NULL if memory could not be allocated
+ * Each thread which filters has its own table of buckets, so none are
+ * written by more than one thread.  When a table is half full it is rebuilt
+ * without the buckets which have refilled, since a full bucket is no
+ * different from a new one.  That also drops the buckets of rules which have
+ * been freed.  The table doubles in size only if a quarter of it is still in
+ * use after that
+ */
+static struct lbucket *lbucket(sf_rule_t *rule, uint32_t src)
+{
+    struct lbuckets *tab,*ntab;
+    struct lbucket *b;
+    uint64_t gen = rule->info.limit->gen;
+    uint64_t now;
+    size_t i,j,size,live;
+
+    (void) pthread_once(&lbucket_once,lbucket_init);
+    tab=(struct lbuckets *) pthread_getspecific(lbucket_key);
+
+    if (tab) {
+        for (i=lhash(gen,src)&tab->mask;(b=&tab->b[i])->gen;
+                i=(i+1)&tab->mask)
+            if (b->gen == gen && b->src == src)
+                return(b);
+    }
+
+    if (tab == NULL || (tab->used+1)*2 > tab->mask+1) {
+        now=mono_ms();
+        size=16;
+        if (tab) {
+            for (live=0,j=0;j<=tab->mask;j++)
+                if (tab->b[j].gen && tab->b[j].tat > now)
+                    live++;
+            size=tab->mask+1;
+            if ((live+1)*4 > size)
+                size*=2;
+        }
+        if ((ntab=(struct lbuckets *) calloc(1,sizeof(struct lbuckets)+
+                size*sizeof(struct lbucket))) == NULL)
+            return(NULL);
+        ntab->mask=size-1;
+        if (tab) {
+            for (j=0;j<=tab->mask;j++) {
+                if (tab->b[j].gen == 0 || tab->b[j].tat <= now)
+                    continue;
+                for (i=lhash(tab->b[j].gen,tab->b[j].src)&ntab->mask;
+                        ntab->b[i].gen;i=(i+1)&ntab->mask);
+                ntab->b[i]=tab->b[j];
+                ntab->used++;
+            }
+        }
+        if (pthread_setspecific(lbucket_key,ntab) != 0) {
+            free(ntab);
+            return(NULL);
+        }
+        free(tab);
+        tab=ntab;
+        for (i=lhash(gen,src)&tab->mask;tab->b[i].gen;i=(i+1)&tab->mask);
+        b=&tab->b[i];
+    }
+
+    b->gen=gen;
+    b->src=src;
+    b->tat=0;
+    tab->used++;
+    return(b);
+}
+
+/*
+ * Apply a LIMIT rule to a sentence
+ * Args: LIMIT rule, sentence's source id with any connection bits masked out
+ * Returns: 0 if there is a token in the source's bucket (which is taken),
+ * -1 otherwise
+ * The bucket is a "generic cell rate algorithm" one: rather than a count of
+ * tokens it records when it will next be full
+ */
+static int ratelimit(sf_rule_t *rule, uint32_t src)
+{
+    struct ratelimit *limit = rule->info.limit;
+    struct lbucket *b;
+    uint64_t now;
+
+    if (limit->interval == 0)
+        return(0);
+    /* If we can't keep track of the source, let it through */
+    if ((b=lbucket(rule,src)) == NULL)
+        return(0);
+    now=mono_ms();
+    if (b->tat > now + (limit->burst-1)*limit->interval)
+        return(-1);
+    b->tat=((b->tat > now)?b->tat:now)+limit->interval;
+    return(0);
 }
 
 /*
@@ -104,10 +530,6 @@ int senfilter(senblk_t *sptr, sfilter_t *filter)
 {
     unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
     sf_rule_t *fptr;
-    char *cptr;
-    int i;
-    time_t tsecs;
-    struct timeval tv;
 
     /* We shouldn't actually be filtering any NULL packets, but check anyway */
     if (sptr == NULL || filter == NULL || filter->rules == NULL)
@@ -118,53 +540,45 @@ int senfilter(senblk_t *sptr, sfilter_t *filter)
     if (*sptr->data == '\r')
         return(1);
 
-    for (fptr=filter->rules;fptr;fptr=fptr->next) {
-        if ((fptr->src.id) && (fptr->src.id != (sptr->src&mask)))
-            continue;
-        for (i=0,cptr=sptr->data+1;i<5 && *cptr != '\r';i++,cptr++)
-            if(fptr->match[i] && fptr->match[i] != *cptr)
-                break;
-        if (i!=5)
-            continue;
+    /* Sentences too short to have a full type never match */
+    if (sptr->type & TYPE_SHORT)
+        return(0);
 
-        if (fptr->type == ACCEPT) {
-            return(0);
-        }
-        if (fptr->type == DENY) {
-            return(-1);
-        }
-        /* type is limit. Hopefully. */
-        (void) gettimeofday(&tv,NULL);
-        if (tv.tv_sec < fptr->info.limit->timeout)
-            return(-1);
-        if ((tsecs=(tv.tv_sec - fptr->info.limit->timeout)) <
-                fptr->info.limit->last.tv_sec)
-            return(-1);
-        if (tsecs == fptr->info.limit->last.tv_sec &&
-                (tv.tv_usec < fptr->info.limit->last.tv_usec ))
-            return(-1);
-        /* at least timeout since last seen: Update info and pass */
-        memcpy(&fptr->info.limit->last,&tv,sizeof(struct timeval));
+    if ((fptr=findrule(filter,sptr->type,sptr->src&mask)) == NULL)
+        return(0);
+
+    if (fptr->type == ACCEPT) {
         return(0);
     }
-    return(0);
+    if (fptr->type == DENY) {
+        return(-1);
+    }
+    /* type is limit. Hopefully. */
+    return(ratelimit(fptr,sptr->src&mask));
 }
 
 /*
- * Free a failover rule and any attached source list
- * Args: Pointer to rule structure
+ * Free a failover rule's sources
+ * Args: Pointer to failover structure
  * Returns: Nothing
  */
-void free_srclist(struct srclist *src)
+void free_failover(struct failover *fo)
 {
-    struct srclist *tsrc;
+    struct srclist *src,*tsrc;
+
+    if (fo == NULL)
+        return;
 
-    for (;src;src=tsrc) {
+    for (src=fo->sources;src;src=tsrc) {
         tsrc=src->next;
-        if (src->src.name)
+        /* Once indexed, sources have ids rather than names */
+        if (fo->index == NULL && src->src.name)
             free(src->src.name);
         free(src);
     }
+    if (fo->index)
+        free(fo->index);
+    free(fo);
 }
 
 /*
@@ -189,10 +603,14 @@ void free_filter(sfilter_t *fptr)
         for (rptr=fptr->rules;rptr;rptr=trptr) {
             trptr=rptr->next;
             if (fptr->type == FAILOVER)
-                free_srclist(rptr->info.source);
+                free_failover(rptr->info.failover);
+            else if (rptr->type == LIMIT)
+                free(rptr->info.limit);
             free(rptr);
         }
 
+    if (fptr->comp)
+        free(fptr->comp);
     free(fptr);
 }
 
@@ -211,49 +629,101 @@ void link_src_to_rule (struct srclist **list, struct srclist *src)
     *list=src;
 }
 
+/*
+ * Hash a failover source id
+ * Args: source id
+ * Returns: hash
+ */
+static inline size_t fohash(uint32_t src)
+{
+    return((size_t) (((uint64_t) src * UINT64_C(0x9e3779b97f4a7c15)) >> 32));
+}
+
+/*
+ * Index a failover rule's sources by id
+ * Args: pointer to failover structure whose sources have ids
+ * Returns: 0 on success, -1 on failure
+ */
+static int index_failover(struct failover *fo)
+{
+    struct srclist *src;
+    size_t size,i;
+    int n;
+
+    for (n=0,src=fo->sources;src;src=src->next)
+        src->n=n++;
+    for (size=4;size < 2*n;size<<=1);
+
+    if ((fo->index=(struct srclist **) calloc(size,sizeof(struct srclist *)))
+            == NULL) {
+        logerr(errno,"Failed to allocate memory for failover");
+        return(-1);
+    }
+    fo->mask=size-1;
+    for (src=fo->sources;src;src=src->next) {
+        for (i=fohash(src->src.id)&fo->mask;fo->index[i];i=(i+1)&fo->mask);
+        fo->index[i]=src;
+    }
+    return(0);
+}
+
 /*
  * Test if a sentence came from a failover input that is active
  * Args: Pointer to filter head, pointer to senblk to be tested
  * Returns: 1 if  senblk should be passed, 0 if not
+ * A source is passed if no source preferred to it has been heard from for
+ * its failtime.  Failtimes increase down the list, so whilst the source
+ * last passed keeps talking nothing preferred to it can have been heard
+ * (it would have been passed instead) and it can be passed without looking
+ * at the others.  Nor need we look further if a source preferred to the
+ * active one is heard: its failtime is no longer
  */
 int isactive(sfilter_t *filter,senblk_t *sptr)
 {
-    time_t now=time(NULL);
     unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
+    struct failover *fo;
+    struct srclist *s,*rptr;
     unsigned int src;
-    char *cptr,*mptr;
     sf_rule_t *rule;
-    struct srclist *rptr;
-    time_t last;
-    int i;
+    uint64_t now,last;
+    char match[6];
+    size_t i;
+    int n;
 
     if (filter == NULL || sptr == NULL)
         return(1);
 
     src = sptr->src & mask;
 
-    for(rule=filter->rules;rule;rule=rule->next) {
-        for (i=0,cptr=sptr->data+1,mptr=rule->match;i<5;i++,cptr++,mptr++)
-            if(*mptr && *cptr != *mptr)
-                break;
-        if (i == 5)
+    if ((rule=findrule(filter,sptr->type,src)) == NULL)
+        return(1);
+    fo=rule->info.failover;
+    for (i=fohash(src)&fo->mask;(s=fo->index[i]);i=(i+1)&fo->mask)
+        if (s->src.id == src)
             break;
+    if (s == NULL)
+        return(0);
+
+    now=mono_ms();
+    s->lasttime=now;
+    if (fo->active == NULL || s->n > fo->active->n) {
+        for (last=0,rptr=fo->sources;rptr != s;rptr=rptr->next)
+            if (rptr->lasttime > last)
+                last = rptr->lasttime;
+        if (last+s->failtime >= now)
+            return(0);
     }
-    if (!rule)
-        return(1);
-    for (last=0,rptr=rule->info.source;rptr;rptr=rptr->next) {
-        if (rptr->src.id == src) {
-            rptr->lasttime = now;
-            if (last+rptr->failtime < now)
-                return(1);
-            else
-                return(0);
-        }
-        if (rptr->lasttime > last)
-            last = rptr->lasttime;
+
+    if (s != fo->active) {
+        fo->active=s;
+        for (n=0;n<5;n++)
+            match[n]=(rule->match[n])?rule->match[n]:'*';
+        match[5]='\0';
+        loginfo("Failover: %s sentences now from %s",match,idlookup(src));
     }
-    return(0);
+    return(1);
 }
+
 /*
  *  Add a failover specification
  *  Args: address of ofilter pointer and pointer to string containing failover
@@ -264,35 +734,46 @@ int isactive(sfilter_t *filter,senblk_t *sptr)
 int addfailover(sfilter_t **head,char *spec)
 {
     sf_rule_t *newrule;
-    struct srclist *src;
+    struct srclist *src=NULL;
     char *cptr,*nptr;
     int n,done;
-    time_t now;
+    uint64_t now;
 
     if ((newrule=(sf_rule_t *)malloc(sizeof(sf_rule_t))) == NULL) {
         return(-1);
     }
-    newrule->info.source=NULL;
+    if ((newrule->info.failover=(struct failover *)
+            calloc(1,sizeof(struct failover))) == NULL) {
+        free(newrule);
+        return(-1);
+    }
+    /* Failover rules are only used to find sources */
+    newrule->type=ACCEPT;
+    newrule->src.id=0;
 
     for (errno=0,cptr=spec,n=0;n<5;spec++,n++,cptr++) {
         if (!*cptr || *cptr== ':') {
+            free_failover(newrule->info.failover);
             free(newrule);
             return(-1);
         }
         newrule->match[n] = (*cptr == '*')?0:*cptr;
     }
+    rule_type(newrule);
 
     if (*cptr++ != ':') {
+        free_failover(newrule->info.failover);
         free(newrule);
         return(-1);
     }
-    for (now=time(NULL),done=0;!done && *cptr;src=NULL,cptr++) {
+    for (now=mono_ms(),done=0;!done && *cptr;src=NULL,cptr++) {
         if ((src=(struct srclist *)malloc(sizeof(struct srclist))) == NULL) {
+            free_failover(newrule->info.failover);
             free(newrule);
             return(-1);
         }
-        for(src->failtime=0;*cptr && *cptr >= '0' && *cptr <= '9';cptr++)
-            src->failtime=src->failtime*10+(*cptr - '0');
+        src->src.name=NULL;
+        cptr=getms(cptr,&src->failtime);
 
         if (*cptr++ != ':')
             break;
@@ -306,12 +787,12 @@ int addfailover(sfilter_t **head,char *spec)
 
         if ((src->src.name = strdup(nptr)) == NULL) {
             logerr(errno,"Failed to allocate memory for string duplication");
-            free(newrule);
-            return(-1);
+            done=0;
+            break;
         }
 
         src->lasttime=now;
-        link_src_to_rule(&newrule->info.source,src);
+        link_src_to_rule(&newrule->info.failover->sources,src);
     }
     if (done) {
         if (!*head) {
@@ -320,6 +801,8 @@ int addfailover(sfilter_t **head,char *spec)
                 (*head)->refcount=1;
                 pthread_mutex_init(&(*head)->lock,NULL);
                 (*head)->rules=NULL;
+                (*head)->comp=NULL;
+                (*head)->limits=0;
             }
         }
         if (*head) {
@@ -330,8 +813,7 @@ int addfailover(sfilter_t **head,char *spec)
     }
     if (src)
         free(src);
-    if (newrule->info.source)
-        free_srclist(newrule->info.source);
+    free_failover(newrule->info.failover);
     free(newrule);
     return(-1);
 }
@@ -355,210 +837,84 @@ void iface_thread_exit(int ret)
 }
 
 /*
- *  Initialise an ioqueue
- *  Args: iface_t to add queue to, size of queue (in senblk structures)
- *  Returns: 0 on success, -1 on failure
+ * Create a thread for an interface or the engine, placed and scheduled as
+ * specified by its "cpus" and "sched" options.  If memory is locked the
+ * thread gets a THRSTACK sized stack
+ * Args: Pointer to thread id to be filled in, scheduling options, function
+ * for the thread to run and its argument
+ * Returns: 0 on success, error number on failure
  */
-int init_q(iface_t *ifa, size_t size)
+int thread_create(pthread_t *tid, struct thrsched *ts,
+        void *(*func)(void *), void *arg)
 {
-    ioqueue_t *newq;
-    senblk_t *sptr;
-    int    i;
-    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
-        return(-1);
-    if ((newq->base=(senblk_t *)calloc(size,sizeof(senblk_t))) ==NULL) {
-        i=errno;
-        free(newq);
-        errno=i;
-        return(-1);
-    }
-
-    /* "base" always points to the allocated memory so that we can free() it.
-     * All senblks initially allocated to the free list
-     */
-    newq->free=newq->base;
-
-    /* Initiailise senblk queue pointers */
-    for (i=0,sptr=newq->free,--size;i<size;++i,++sptr)
-        sptr->next=sptr+1;
-
-    sptr->next = NULL;
-
-    newq->qhead = newq->qtail = NULL;
-    newq->owner=ifa;
-
-    pthread_mutex_init(&newq->q_mutex,NULL);
-    pthread_cond_init(&newq->freshmeat,NULL);
-
-    newq->active=1;
-    ifa->q=newq;
-    return(0);
-}
+    pthread_attr_t attr;
+    struct sched_param sp;
+#ifdef __linux__
+    cpu_set_t cs;
+    int i;
+#endif
+    int err;
 
-/*
- *  Copy information in a senblk structure (data and len only)
- *  Args: pointers to dest and source senblk structures
- *  Returns: pointer to dest senblk
- */
-senblk_t *senblk_copy(senblk_t *dptr,senblk_t *sptr)
-{
-    dptr->len=sptr->len;
-    dptr->src=sptr->src;
-    dptr->next=NULL;
-    return (senblk_t *) memcpy((void *)dptr->data,(const void *)sptr->data,
-            sptr->len);
-}
+    if (ts->ncpus == 0 && !ts->setsched && !thrstack)
+        return(pthread_create(tid,NULL,func,arg));
 
-/*
- * Add an senblk to an ioqueue
- * Args: Pointer to senblk and Pointer to queue it is to be added to
- * Returns: None
- */
-void push_senblk(senblk_t *sptr, ioqueue_t *q)
-{
-    senblk_t *tptr;
+    if ((err=pthread_attr_init(&attr)) != 0)
+        return(err);
 
-    pthread_mutex_lock(&q->q_mutex);
+    if (thrstack && (err=pthread_attr_setstacksize(&attr,thrstack)) != 0)
+        goto done;
 
-    if (sptr == NULL) {
-        /* NULL senblk pointer is magic "off" switch for a queue */
-        q->active = 0;
-    } else {
-        /* Get a senblk from the queue's free list if possible...*/
-        if (q->free) {
-            tptr=q->free;
-            q->free=q->free->next;
-        } else {
-            /* ...if not steal from the head of the queue, dropping previous
-               contents. */
-            tptr=q->qhead;
-            q->qhead=q->qhead->next;
-            if (q->drops < 0)
-                q->drops++;
-            DEBUG(4,"Dropped senblk q=%s",(q->owner->name)?q->owner->name:"(unknown)");
-        }
-    
-        (void) senblk_copy(tptr,sptr);
-    
-        /* If there is anything on the queue already, set it's "next" member
-           to point to the new senblk */
-        if (q->qtail)
-            q->qtail->next=tptr;
-    
-        /* Set tail pointer to the new senblk */
-        q->qtail=tptr;
-    
-        /* queue head needs to point to new senblk if there was nothing
-           previously on the queue */
-        if (q->qhead == NULL)
-            q->qhead=tptr;
-    
+#ifdef __linux__
+    if (ts->ncpus) {
+        CPU_ZERO(&cs);
+        for (i=0;i<MAXCPUS;i++)
+            if (ts->cpus[i/8] & (1 << (i%8)))
+                CPU_SET(i,&cs);
+        if ((err=pthread_attr_setaffinity_np(&attr,sizeof(cs),&cs)) != 0)
+            goto done;
     }
-    pthread_cond_broadcast(&q->freshmeat);
-    pthread_mutex_unlock(&q->q_mutex);
-}
-
-/*
- *  Get the next senblk from the head of a queue
- *  Args: Queue to retrieve from
- *  Returns: Pointer to next senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
- */
-senblk_t *next_senblk(ioqueue_t *q)
-{
-    senblk_t *tptr;
+#endif
 
-    pthread_mutex_lock(&q->q_mutex);
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
-        }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+    if (ts->setsched) {
+        sp.sched_priority=ts->priority;
+        if ((err=pthread_attr_setinheritsched(&attr,PTHREAD_EXPLICIT_SCHED))
+                || (err=pthread_attr_setschedpolicy(&attr,ts->policy))
+                || (err=pthread_attr_setschedparam(&attr,&sp)))
+            goto done;
     }
 
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
-    return(tptr);
+    err=pthread_create(tid,&attr,func,arg);
+done:
+    pthread_attr_destroy(&attr);
+    return(err);
 }
 
 /*
- *  Get the last senblk from a queue, discarding all before it
- *  Args: Queue to retrieve from
- *  Returns: Pointer to last senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
+ * Thread function which does nothing.  See check_thread()
  */
-senblk_t *last_senblk(ioqueue_t *q)
+static void *null_thread(void *arg)
 {
-    senblk_t *tptr,*nptr;
-
-    pthread_mutex_lock(&q->q_mutex);
-    /* Move all but last senblk on the queue to the free list */
-    if ((tptr=q->qhead) != NULL) {
-        for (nptr=tptr->next;nptr;tptr=nptr,nptr=nptr->next) {
-            tptr->next=q->free;
-            q->free=tptr;
-        }
-        q->qhead=tptr;
-    }
-
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
-        }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
-    }
-
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
-    return(tptr);
+    return(NULL);
 }
 
 /*
- * Flush a queue, returning anything on it to the free list
- * Args: Queue to be flushed
- * Returns: Nothing
- * Side Effect: Returns anything on the queue to the free list
+ * Check that a thread can be created with given placement and scheduling
+ * options, e.g. that the CPUs exist and we're allowed to use real time
+ * scheduling
+ * Args: scheduling options
+ * Returns: 0 if so, error number otherwise
  */
-void flush_queue(ioqueue_t *q)
+int check_thread(struct thrsched *ts)
 {
-    pthread_mutex_lock(&q->q_mutex);
-    if (q->qhead != NULL) {
-        q->qtail->next = q->free;
-        q->free=q->qhead;
-        q->qhead=q->qtail=NULL;
-    }
-    pthread_mutex_unlock(&q->q_mutex);
-}
+    pthread_t tid;
+    int err;
 
-/*
- * Return a senblk to a queue's free list
- * Args: pointer to senblk, and pointer to the queue whose free list it is to
- * be added to
- * Returns: Nothing
- */
-void senblk_free(senblk_t *sptr, ioqueue_t *q)
-{
-    pthread_mutex_lock(&q->q_mutex);
-    /* Adding to head of free list is quicker than tail */
-    sptr->next = q->free;
-    q->free=sptr;
-    pthread_mutex_unlock(&q->q_mutex);
+    if (ts->ncpus == 0 && !ts->setsched)
+        return(0);
+
+    if ((err=thread_create(&tid,ts,null_thread,NULL)) == 0)
+        pthread_join(tid,NULL);
+    return(err);
 }
 
 iface_t *get_default_global()
@@ -617,25 +973,360 @@ int process_prop(senblk_t *sptr, iface_t *eptr)
     sptr->len+=sprintf(sptr->data+sptr->len,"*%02X\r\n",
             calcsum(sptr->data+1,sptr->len-1));
     sptr->src=0;
+    senindex(sptr);
     return(0);
 }
 
+/*
+ * Free retired output list snapshots (releasing their references to output
+ * filters) and the queues of departed outputs unless dispatch() might still
+ * be using them
+ * Args: Pointer to iolists
+ * Returns: Nothing
+ * io_mutex must be held.  If dispatch() is in the way, lists->reclaim is set
+ * and dispatch() calls this again when it has finished with its snapshot
+ */
+static void reclaim_outputs(struct iolists *lists)
+{
+    struct outsnap *snap;
+    ioqueue_t *q;
+    int i;
+
+    /* Only one dispatch() runs at a time.  Anything retired is safe to free
+     * unless that is using a snapshot other than the current one */
+    snap=atomic_load(&lists->hazard);
+    if (snap != NULL && snap != atomic_load(&lists->snap)) {
+        atomic_store(&lists->reclaim,
+                lists->retired != NULL || lists->retiredq != NULL);
+        return;
+    }
+
+    while ((snap=lists->retired) != NULL) {
+        lists->retired=snap->next;
+        for (i=0;i<snap->n;i++)
+            free_filter(snap->out[i].filter);
+        if (snap->sub)
+            free(snap->sub);
+        free(snap);
+    }
+    while ((q=lists->retiredq) != NULL) {
+        lists->retiredq=q->next;
+        free_q(q);
+    }
+    atomic_store(&lists->reclaim,0);
+}
+
+/*
+ * Replace the snapshot of the output list used by dispatch()
+ * Args: Pointer to iolists
+ * Returns: 0 on success, -1 on failure
+ * io_mutex must be held.  This must be called whenever an output is added to
+ * or removed from the output list or an output's queue is created
+ */
+int publish_outputs(struct iolists *lists)
+{
+    struct outsnap *snap;
+    iface_t *optr;
+    int n,nsub;
+
+    for (n=nsub=0,optr=lists->outputs;optr;optr=optr->next)
+        if (optr->q) {
+            n++;
+            if (optr->ofilter && optr->ofilter->limits == 0)
+                nsub++;
+        }
+
+    if ((snap=(struct outsnap *) malloc(sizeof(struct outsnap) +
+            n*sizeof(struct outent))) == NULL) {
+        logerr(errno,"Failed to update output list");
+        return(-1);
+    }
+
+    /* Only worth indexing if some output filters can be applied here */
+    snap->words=(n+63)/64;
+    if (nsub == 0)
+        snap->sub=NULL;
+    else if ((snap->sub=(struct subent *) calloc(SUBCACHE,
+            SUBENTSZ(snap))) == NULL) {
+        logerr(errno,"Failed to update output list");
+        free(snap);
+        return(-1);
+    }
+
+    for (n=0,optr=lists->outputs;optr;optr=optr->next) {
+        if (optr->q == NULL)
+            continue;
+        /* Queues created before their interface was named are named now,
+         * before dispatch() can see them */
+        if (*optr->q->name == '\0' && optr->name)
+            (void) snprintf(optr->q->name,QNAMESZ,"%s",optr->name);
+        snap->out[n].q=optr->q;
+        snap->out[n].id=optr->id;
+        snap->out[n].loopback=flag_test(optr,F_LOOPBACK)?1:0;
+        /* The snapshot holds a reference: the output may be gone (and have
+         * released its own) before dispatch() has finished with it */
+        snap->out[n++].filter=(optr->ofilter && optr->ofilter->limits == 0)?
+                addfilter(optr->ofilter):NULL;
+    }
+    snap->n=n;
+
+    if ((snap->next=atomic_exchange(&lists->snap,snap)) != NULL) {
+        snap->next->next=lists->retired;
+        lists->retired=snap->next;
+        snap->next=NULL;
+    }
+    reclaim_outputs(lists);
+    return(0);
+}
+
+/*
+ * Find the outputs in a snapshot which want a sentence
+ * Args: Pointer to snapshot, pointer to senblk
+ * Returns: Pointer to bitmap of outputs by position in the snapshot
+ * Whether an output wants a sentence depends only on its type and source,
+ * unless the output's filter has LIMIT rules, in which case the output is
+ * given everything and left to filter it itself.  Results are cached by type
+ * and source in the snapshot, so output filters are applied here once for
+ * each new combination and not at all by the outputs.  Only the thread
+ * running dispatch() may call this
+ */
+static uint64_t *subscribers(struct outsnap *snap, senblk_t *sptr)
+{
+    struct subent *e;
+    struct outent *ent;
+    int i;
+
+    e=(struct subent *) ((char *) snap->sub +
+            (fhash(0,sptr->type,sptr->src)&(SUBCACHE-1))*SUBENTSZ(snap));
+    if (e->valid && e->type == sptr->type && e->src == sptr->src)
+        return(e->want);
+
+    e->type=sptr->type;
+    e->src=sptr->src;
+    e->valid=1;
+    memset(e->want,0,snap->words*sizeof(uint64_t));
+    for (i=0,ent=snap->out;i<snap->n;i++,ent++)
+        if ((sptr->src != ent->id || ent->loopback) &&
+                senfilter(sptr,ent->filter) == 0)
+            e->want[i/64]|=(uint64_t) 1 << (i%64);
+    return(e->want);
+}
+
+/*
+ * Pass a sentence to all the outputs which should receive it
+ * Args: Pointer to senblk (from the senblk pool), pointer to engine
+ * Returns: Nothing
+ * This is called by the engine or, in direct dispatch mode, by each input
+ * thread.  Outputs are found from an immutable snapshot of the output list
+ * so io_mutex is not needed.  Whilst a snapshot is in use it is advertised
+ * in lists->hazard so that it (and the queues in it) are not freed.
+ */
+void dispatch(senblk_t *sptr, iface_t *eptr)
+{
+    struct iolists *lists = eptr->lists;
+    struct outsnap *snap;
+    struct outent *ent;
+    int direct=((struct if_engine *) eptr->info)->flags & K_DIRECT;
+    uint64_t *want,bits;
+    int i;
+
+    if (isprop(sptr)) {
+        if (process_prop(sptr,eptr))
+            return;
+    }
+
+    /* Direct dispatching inputs take turns.  This keeps output queues
+     * single producer and protects failover state in isactive() */
+    if (direct)
+        pthread_mutex_lock(&lists->dispatch_mutex);
+
+    if (isactive(eptr->ofilter,sptr)) {
+        sptr->prio=sen_prio(sptr);
+        do {
+            snap=atomic_load(&lists->snap);
+            atomic_store(&lists->hazard,snap);
+        } while (snap != atomic_load(&lists->snap));
+
+        if (snap && snap->sub) {
+            want=subscribers(snap,sptr);
+            for (i=0;i<snap->words;i++)
+                for (bits=want[i];bits;bits&=bits-1)
+                    push_senblk_ref(sptr,
+                            snap->out[i*64+__builtin_ctzll(bits)].q);
+        } else if (snap)
+            for (i=0,ent=snap->out;i<snap->n;i++,ent++)
+                if (sptr->src != ent->id || ent->loopback)
+                    push_senblk_ref(sptr,ent->q);
+
+        atomic_store_explicit(&lists->hazard,NULL,memory_order_release);
+
+        /* Free anything retired whilst we were using the snapshot.  If
+         * io_mutex is busy, leave it for next time */
+        if (atomic_load(&lists->reclaim) &&
+                pthread_mutex_trylock(&lists->io_mutex) == 0) {
+            reclaim_outputs(lists);
+            pthread_mutex_unlock(&lists->io_mutex);
+        }
+    }
+
+    if (direct)
+        pthread_mutex_unlock(&lists->dispatch_mutex);
+}
+
+/*
+ * Note that the input list has changed so the engine picks up new inputs'
+ * queues in fair dispatch mode
+ * Args: Pointer to iolists
+ * Returns: Nothing
+ * io_mutex must be held
+ */
+static void inputs_changed(struct iolists *lists)
+{
+    if (!(((struct if_engine *) lists->engine->info)->flags & K_FAIR))
+        return;
+    atomic_store(&lists->inchanged,1);
+    wake_q(lists->engine->q);
+}
+
+/*
+ * Give an input the queue it uses to pass sentences to the engine
+ * Args: Pointer to input interface
+ * Returns: 0 on success, -1 on failure
+ * Normally this is the engine's own queue.  In fair dispatch mode each input
+ * has its own
+ */
+int attach_input(iface_t *ifa)
+{
+    iface_t *eptr=ifa->lists->engine;
+
+    if (!(((struct if_engine *) eptr->info)->flags & K_FAIR)) {
+        ifa->q=eptr->q;
+        return(0);
+    }
+    return(init_ingress_q(ifa,eptr->q));
+}
+
+/*
+ * Pass on everything left on a departed input's queue and free it
+ * Args: Pointer to queue, pointer to engine
+ * Returns: Nothing
+ */
+static void drain_ingress(ioqueue_t *q, iface_t *eptr)
+{
+    senblk_t *sptr;
+
+    while ((sptr=take_senblk(q)) != NULL) {
+        dispatch(sptr,eptr);
+        senblk_free(sptr,q);
+    }
+    free_q(q);
+}
+
+/*
+ * Rebuild the engine's list of queues to service in fair dispatch mode
+ * Args: Pointer to engine, pointer to current array of queues (which may be
+ * reallocated), pointer to its size
+ * Returns: Number of queues in the new list
+ * The engine's own queue is always first.  Queues of inputs which have gone
+ * are passed on and freed once they are no longer in the list
+ */
+static int rebuild_ingress(iface_t *eptr, ioqueue_t ***inp, int *size)
+{
+    struct iolists *lists=eptr->lists;
+    ioqueue_t **in,*q,*retired;
+    iface_t *ifa;
+    int n,count;
+
+    pthread_mutex_lock(&lists->io_mutex);
+    atomic_store(&lists->inchanged,0);
+    for (count=1,ifa=lists->inputs;ifa;ifa=ifa->next)
+        if (ifa->q && ifa->q->notify)
+            count++;
+
+    if (count > *size) {
+        if ((in=(ioqueue_t **) realloc(*inp,count*sizeof(ioqueue_t *)))
+                == NULL) {
+            /* Keep the old list minus any departed inputs and try again
+             * next time round */
+            logerr(errno,"Failed to update engine input list");
+            atomic_store(&lists->inchanged,1);
+            count=*size;
+        } else {
+            *inp=in;
+            *size=count;
+        }
+    }
+
+    in=*inp;
+    in[0]=eptr->q;
+    eptr->q->weight=1;
+    for (n=1,ifa=lists->inputs;ifa && n < count;ifa=ifa->next)
+        if (ifa->q && ifa->q->notify)
+            in[n++]=ifa->q;
+
+    retired=lists->retiredin;
+    lists->retiredin=NULL;
+    pthread_mutex_unlock(&lists->io_mutex);
+
+    while ((q=retired) != NULL) {
+        retired=q->next;
+        drain_ingress(q,eptr);
+    }
+    return(n);
+}
+
 /*
  * This is the heart of the multiplexer.  All inputs add to the tail of the
- * Engine's queue.  The engine takes from the head of its queue and copies
- * to all outputs on its output list.
+ * Engine's queue.  The engine takes from the head of its queue and passes
+ * a reference to it to all outputs on its output list.
+ * In direct dispatch mode inputs call dispatch() themselves and the engine's
+ * queue remains empty until it is shut down.
+ * In fair dispatch mode each input has its own queue.  The engine takes from
+ * them in turn using deficit round robin: on each round an input's deficit
+ * is credited with its weight times DRRQUANTUM bytes, and it may pass on
+ * sentences until its deficit is used up.  An input with nothing queued
+ * loses its deficit.
  * Args: Pointer to information structure (iface_t, cast to void)
  * Returns: Nothing
  */
 void *run_engine(void *info)
 {
     senblk_t *sptr;
-    iface_t *optr;
     iface_t *eptr = (iface_t *)info;
+    ioqueue_t **in=NULL,*q;
+    int i,n=0,size=0,took;
     int retval=0;
 
     (void) pthread_detach(pthread_self());
 
+    if (((struct if_engine *) eptr->info)->flags & K_FAIR) {
+        for (;;) {
+            if (atomic_load(&eptr->lists->inchanged))
+                n=rebuild_ingress(eptr,&in,&size);
+
+            for (i=0,took=0;i<n;i++) {
+                q=in[i];
+                q->deficit+=q->weight*DRRQUANTUM;
+                while (q->deficit > 0) {
+                    if ((sptr=take_senblk(q)) == NULL) {
+                        q->deficit=0;
+                        break;
+                    }
+                    q->deficit-=sptr->len;
+                    dispatch(sptr,eptr);
+                    senblk_free(sptr,q);
+                    took++;
+                }
+            }
+
+            if (!took && ingress_wait(eptr->q,in,n,
+                    &eptr->lists->inchanged) < 0)
+                break;
+        }
+        free(in);
+        pthread_exit(&retval);
+    }
+
     for (;;) {
         sptr = next_senblk(eptr->q);
 
@@ -643,24 +1334,7 @@ void *run_engine(void *info)
             /* Queue has been marked inactive */
             break;
 
-        if (isprop(sptr)) {
-            if (process_prop(sptr,eptr)) {
-                senblk_free(sptr,eptr->q);
-                continue;
-            }
-        }
-
-        if (isactive(eptr->ofilter,sptr)) {
-            pthread_mutex_lock(&eptr->lists->io_mutex);
-            /* Traverse list of outputs and push a copy of senblk to each */
-            for (optr=eptr->lists->outputs;optr;optr=optr->next) {
-                if ((optr->q) && ((!sptr) ||
-                        ((sptr->src != optr->id) || (flag_test(optr,F_LOOPBACK))))) {
-                    push_senblk(sptr,optr->q);
-                }
-            }
-            pthread_mutex_unlock(&eptr->lists->io_mutex);
-        }
+        dispatch(sptr,eptr);
         senblk_free(sptr,eptr->q);
     }
     pthread_exit(&retval);
@@ -712,6 +1386,10 @@ void start_interface(void *ptr)
     else
         ifa->next=NULL;
     (*lptr)=ifa;
+    if (ifa->direction != IN)
+        (void) publish_outputs(ifa->lists);
+    else
+        inputs_changed(ifa->lists);
 
     if (ifa->lists->initialized == NULL)
         pthread_cond_broadcast(&ifa->lists->init_cond);
@@ -745,6 +1423,29 @@ int link_to_initialized(iface_t *ifa)
     return(0);
 }
 
+/*
+ * Take an interface whose thread could not be started off the initialized
+ * list
+ * Args: interface structure pointer
+ * Returns: Nothing
+ * Side Effects: Threads waiting for the initialized list to empty are woken
+ * if this was the last interface on it
+ * io_mutex must be held
+ */
+void unlink_initialized(iface_t *ifa)
+{
+    iface_t **iptr;
+
+    for (iptr=&ifa->lists->initialized;(*iptr);iptr=&(*iptr)->next)
+        if ((*iptr) == ifa) {
+            (*iptr)=ifa->next;
+            break;
+        }
+    ifa->next=NULL;
+    if (ifa->lists->initialized == NULL)
+        pthread_cond_broadcast(&ifa->lists->init_cond);
+}
+
 /*
  * Free all the data associated with an interface except the iface_t itself
  * Args: Pointer to iface_t to be freed
@@ -758,8 +1459,10 @@ void free_if_data(iface_t *ifa)
 {
     if ((ifa->direction == OUT) && ifa->q) {
         /* output interfaces have queues which need freeing */
-        free(ifa->q->base);
-        free(ifa->q);
+        free_q(ifa->q);
+    } else if ((ifa->direction == IN) && ifa->q && ifa->q->notify) {
+        /* as do inputs in fair dispatch mode which never got started */
+        free_q(ifa->q);
     }
 
     free_filter(ifa->ifilter);
@@ -774,10 +1477,7 @@ void free_if_data(iface_t *ifa)
     if (ifa->pair) {
         ifa->pair->pair=NULL;
         if (ifa->pair->direction == OUT) {
-            pthread_mutex_lock(&ifa->pair->q->q_mutex);
-            ifa->pair->q->active=0;
-            pthread_cond_broadcast(&ifa->pair->q->freshmeat);
-            pthread_mutex_unlock(&ifa->pair->q->q_mutex);
+            push_senblk(NULL,ifa->pair->q);
         } else {
             if (ifa->pair->tid)
                 pthread_kill(ifa->pair->tid,SIGUSR1);
@@ -815,6 +1515,26 @@ int unlink_interface(iface_t *ifa)
             for (tptr=(*lptr);tptr->next != ifa;tptr=tptr->next);
             tptr->next = ifa->next;
         }
+
+        if (ifa->direction != IN) {
+            /* dispatch() may still be using our queue so it is freed later
+             * by reclaim_outputs().  If we can't stop dispatch() seeing it,
+             * it is never freed */
+            if (publish_outputs(ifa->lists) == 0 &&
+                    ifa->direction == OUT && ifa->q) {
+                ifa->q->next=ifa->lists->retiredq;
+                ifa->lists->retiredq=ifa->q;
+                reclaim_outputs(ifa->lists);
+            }
+            if (ifa->direction == OUT)
+                ifa->q=NULL;
+        } else if (ifa->q && ifa->q->notify) {
+            /* The engine passes on anything left on our queue then frees it */
+            ifa->q->next=ifa->lists->retiredin;
+            ifa->lists->retiredin=ifa->q;
+            ifa->q=NULL;
+            inputs_changed(ifa->lists);
+        }
     
         if (ifa->direction != OUT)
             if (!ifa->lists->inputs) {
@@ -822,10 +1542,7 @@ int unlink_interface(iface_t *ifa)
                     if (tptr->direction == BOTH)
                         break;
                 if (tptr == NULL) {
-                    pthread_mutex_lock(&ifa->lists->engine->q->q_mutex);
-                    ifa->lists->engine->q->active=0;
-                    pthread_cond_broadcast(&ifa->lists->engine->q->freshmeat);
-                    pthread_mutex_unlock(&ifa->lists->engine->q->q_mutex);
+                    push_senblk(NULL,ifa->lists->engine->q);
                     if (timetodie == 0)
                         timetodie++;
                 }
@@ -928,6 +1645,11 @@ iface_t *ifdup (iface_t *ifa)
     newif->ofilter=addfilter(ifa->ofilter);
     newif->checksum=ifa->checksum;
     newif->strict=ifa->strict;
+    newif->senmax=ifa->senmax;
+    newif->weight=ifa->weight;
+    newif->qpolicy=ifa->qpolicy;
+    newif->qblock=ifa->qblock;
+    newif->sched=ifa->sched;
     return(newif);
 }
 
@@ -1067,11 +1789,11 @@ int name2id(sfilter_t *filter)
             rptr->src.name=NULL;
             rptr->src.id=id;
         }
-        return(0);
+        return(compile_filter(filter));
     }
     
-    for (rptr=filter->rules;rptr;rptr=rptr->next)
-        for (sptr=rptr->info.source;sptr;sptr=sptr->next) {
+    for (rptr=filter->rules;rptr;rptr=rptr->next) {
+        for (sptr=rptr->info.failover->sources;sptr;sptr=sptr->next) {
             if (!(id=namelookup(sptr->src.name))) {
                logwarn("Unknown interface \'%s\' in failover rules",sptr->src.name);
                 return(-1);
@@ -1080,7 +1802,10 @@ int name2id(sfilter_t *filter)
             sptr->src.name=NULL;
             sptr->src.id=id;
         }
-    return(0);
+        if (index_failover(rptr->info.failover) < 0)
+            return(-1);
+    }
+    return(compile_filter(filter));
 }
 
 int proc_engine_options(iface_t *e_info,struct kopts *options)
@@ -1109,6 +1834,19 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
                 ifg->flags &= ~K_BACKGROUND;
             else
                 fprintf(stderr,"Warning: unrecognized mode \'%s\' specified\n",optr->val);
+        } else if (!strcasecmp(optr->var,"dispatch")) {
+            if (!strcasecmp(optr->val,"direct")) {
+                ifg->flags|=K_DIRECT;
+                ifg->flags &= ~K_FAIR;
+            } else if (!strcasecmp(optr->val,"fair")) {
+                ifg->flags|=K_FAIR;
+                ifg->flags &= ~K_DIRECT;
+            } else if (!strcasecmp(optr->val,"engine"))
+                ifg->flags &= ~(K_DIRECT|K_FAIR);
+            else {
+                fprintf(stderr,"Dispatch option must be one of \'engine\', \'direct\' or \'fair\'\n");
+                exit(1);
+            }
         } else if (!strcasecmp(optr->var,"logto")) {
             if ((ifg->logto = string2facility(optr->val)) < 0) {
                 fprintf(stderr,"Unknown log facility \'%s\' specified\n",optr->val);
@@ -1145,6 +1883,41 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
                 fprintf(stderr,"Strict option must be either \'yes\' or \'no\'\n");
                 exit(1);
             }
+        } else if (!strcasecmp(optr->var,"senmax")) {
+            if ((e_info->senmax=atoi(optr->val)) <= 0 ||
+                    e_info->senmax > MAXSENMAX) {
+                fprintf(stderr,"Senmax must be between 1 and %d\n",
+                        (int) MAXSENMAX);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"highprio") ||
+                !strcasecmp(optr->var,"lowprio")) {
+            if (add_prio(optr->val,(strcasecmp(optr->var,"highprio"))?
+                    PRIO_LOW:PRIO_HIGH) != 0) {
+                fprintf(stderr,"Bad sentence type list for %s: %s\n",
+                        optr->var,optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"cpus")) {
+            if (parse_cpus(optr->val,&e_info->sched) < 0) {
+                fprintf(stderr,"Bad CPU list for engine: %s\n",optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"sched")) {
+            if (parse_sched(optr->val,&e_info->sched) < 0) {
+                fprintf(stderr,"Bad scheduling option for engine: %s\n",
+                        optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"mlockall")) {
+            if (!strcasecmp(optr->val,"yes"))
+                ifg->flags|=K_MLOCK;
+            else if (!strcasecmp(optr->val,"no"))
+                ifg->flags &= ~K_MLOCK;
+            else {
+                fprintf(stderr,"mlockall option must be either \'yes\' or \'no\'\n");
+                exit(1);
+            }
         } else if (!strcasecmp(optr->var,"failover")) {
             if (addfailover(&e_info->ofilter,optr->val) != 0) {
                 fprintf(stderr,"Failed to add failover %s\n",optr->val);
@@ -1156,21 +1929,37 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
         }
     }
 
-    if (init_q(e_info, qsize) < 0) {
+    if (init_engine_q(e_info, qsize) < 0) {
         perror("failed to initiate queue");
         exit(1);
     }
     return(0);
 }
 
+/*
+ * Calculate an NMEA 0183 checksum, a word at a time
+ * Args: pointer to data, length of data
+ * Returns: XOR of the data's chars
+ */
 int calcsum(const char *buf, size_t len)
 {
-    int c = 0;
+    uint64_t w,x=0;
+    unsigned char c;
+
+    for (;len >= sizeof(w);len-=sizeof(w),buf+=sizeof(w)) {
+        memcpy(&w,buf,sizeof(w));
+        x^=w;
+    }
+    x^=x>>32;
+    x^=x>>16;
+    x^=x>>8;
 
-    for (;len;len--)
-        c ^=*buf++;
+    for (c=(unsigned char) x;len;len--)
+        c^=*buf++;
 
-    return c;
+    /* As if the chars had been XORed as ints, so that callers comparing
+     * against hexsum() see what they always have */
+    return((int)(char) c);
 }
 
 /* Add tag data
@@ -1182,7 +1971,6 @@ size_t gettag(iface_t *ifa, char *buf, senblk_t *sptr)
     char *ptr=buf;
     char *nameptr;
     int first=1;
-    struct timeval tv;
     unsigned char cksum;
     size_t len;
 
@@ -1206,15 +1994,184 @@ size_t gettag(iface_t *ifa, char *buf, senblk_t *sptr)
             *ptr++=',';
         memcpy(ptr,"c:",2);
         ptr+=2;
-        (void) gettimeofday(&tv,NULL);
-        ptr+=sprintf(ptr,"%010u",(unsigned) tv.tv_sec);
-        if (ifa->tagflags & TAG_MS)
-            ptr += sprintf(ptr,"%03u",((unsigned) tv.tv_usec)/1000);
+        ptr+=tagtime(ptr,ifa->tagflags & TAG_MS);
     }
     /* Don't include initial '/' */
-    cksum=calcsum(buf+1,(len=ptr-buf)-1);
-    len+=sprintf(ptr,"*%02X\\",cksum);
-    return(len);
+    cksum=calcsum(buf+1,ptr-buf-1);
+    *ptr++='*';
+    *ptr++="0123456789ABCDEF"[cksum>>4];
+    *ptr++="0123456789ABCDEF"[cksum&0xf];
+    *ptr++='\\';
+    return(ptr-buf);
+}
+
+/*
+ * Get the next batch of sentences for an output to write, discarding any
+ * which don't pass its output filter
+ * Args: output interface, array of WBATCH senblk pointers to be filled in,
+ * array of WBATCH iovecs to be filled in with the sentences' tags, pointer
+ * to tag buffer of WBATCH * TAGMAX bytes (NULL if tagging is off)
+ * Returns: Number of senblks in the batch, 0 if the queue has been shut down
+ * Side effects: If tags can't be generated, tagging is turned off and the
+ * tag buffer freed.  Tag iovecs are zero length if tagging is off
+ */
+int next_batch(iface_t *ifa, senblk_t **sv, struct iovec *tv, char **tbuf)
+{
+    int i,n,cnt;
+
+    do {
+        if ((cnt=next_senblk_batch(ifa->q,sv,WBATCH)) == 0)
+            return(0);
+
+        for (i=n=0;i<cnt;i++) {
+            /* dispatch() has already applied filters without LIMIT rules */
+            if (ifa->ofilter && ifa->ofilter->limits &&
+                    senfilter(sv[i],ifa->ofilter)) {
+                senblk_free(sv[i],ifa->q);
+                continue;
+            }
+            sv[n]=sv[i];
+            tv[n].iov_len=0;
+            if (ifa->tagflags) {
+                tv[n].iov_base=*tbuf+n*TAGMAX;
+                if ((tv[n].iov_len = gettag(ifa,tv[n].iov_base,sv[n])) == 0) {
+                    logerr(errno,"Disabing tag output on interface id %x (%s)",
+                            ifa->id,(ifa->name)?ifa->name:"unlabelled");
+                    ifa->tagflags=0;
+                    free(*tbuf);
+                    *tbuf=NULL;
+                }
+            }
+            n++;
+        }
+    } while (n == 0);
+
+    return(n);
+}
+
+/*
+ * Write an array of iovecs to a stream, retrying after partial writes
+ * Args: file descriptor, array of iovecs, number of iovecs
+ * Returns: 0 on success, -1 on failure
+ * Side effects: iovecs are modified
+ */
+int writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while (cnt) {
+        if ((n=writev(fd,iov,cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+        for (;cnt && (size_t) n >= iov->iov_len;cnt--,iov++)
+            n-=iov->iov_len;
+        if (cnt) {
+            iov->iov_base=(char *)iov->iov_base+n;
+            iov->iov_len-=n;
+        }
+    }
+    return(0);
+}
+
+/* Characters which do_read() treats specially */
+static const unsigned char delimtab[256] = {
+    ['$']=1, ['!']=1, ['\\']=1, ['\r']=1, ['\n']=1, ['\0']=1
+};
+
+#if defined(__AVX2__)
+/*
+ * Find which of 32 bytes are characters do_read() treats specially
+ * Args: Pointer to data
+ * Returns: Mask with a bit set for each special character
+ */
+static inline unsigned int delims32(const char *bptr)
+{
+    __m256i b=_mm256_loadu_si256((const __m256i *) bptr);
+    __m256i m;
+
+    m=_mm256_or_si256(_mm256_cmpeq_epi8(b,_mm256_set1_epi8('$')),
+            _mm256_cmpeq_epi8(b,_mm256_set1_epi8('!')));
+    m=_mm256_or_si256(m,_mm256_cmpeq_epi8(b,_mm256_set1_epi8('\\')));
+    m=_mm256_or_si256(m,_mm256_cmpeq_epi8(b,_mm256_set1_epi8('\r')));
+    m=_mm256_or_si256(m,_mm256_cmpeq_epi8(b,_mm256_set1_epi8('\n')));
+    m=_mm256_or_si256(m,_mm256_cmpeq_epi8(b,_mm256_setzero_si256()));
+    return((unsigned int) _mm256_movemask_epi8(m));
+}
+#endif
+
+#if defined(__SSE2__)
+/*
+ * Find which of 16 bytes are characters do_read() treats specially
+ * Args: Pointer to data
+ * Returns: Mask with a bit set for each special character
+ */
+static inline unsigned int delims16(const char *bptr)
+{
+    __m128i b=_mm_loadu_si128((const __m128i *) bptr);
+    __m128i m;
+
+    m=_mm_or_si128(_mm_cmpeq_epi8(b,_mm_set1_epi8('$')),
+            _mm_cmpeq_epi8(b,_mm_set1_epi8('!')));
+    m=_mm_or_si128(m,_mm_cmpeq_epi8(b,_mm_set1_epi8('\\')));
+    m=_mm_or_si128(m,_mm_cmpeq_epi8(b,_mm_set1_epi8('\r')));
+    m=_mm_or_si128(m,_mm_cmpeq_epi8(b,_mm_set1_epi8('\n')));
+    m=_mm_or_si128(m,_mm_cmpeq_epi8(b,_mm_setzero_si128()));
+    return((unsigned int) _mm_movemask_epi8(m));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+/*
+ * Find whether any of 16 bytes are characters do_read() treats specially
+ * Args: Pointer to data
+ * Returns: Non-zero if any are
+ */
+static inline unsigned int delims16(const char *bptr)
+{
+    uint8x16_t b=vld1q_u8((const uint8_t *) bptr);
+    uint8x16_t m;
+
+    m=vorrq_u8(vceqq_u8(b,vdupq_n_u8('$')),vceqq_u8(b,vdupq_n_u8('!')));
+    m=vorrq_u8(m,vceqq_u8(b,vdupq_n_u8('\\')));
+    m=vorrq_u8(m,vceqq_u8(b,vdupq_n_u8('\r')));
+    m=vorrq_u8(m,vceqq_u8(b,vdupq_n_u8('\n')));
+    m=vorrq_u8(m,vceqq_u8(b,vdupq_n_u8(0)));
+    return(vmaxvq_u8(m));
+}
+#endif
+
+/*
+ * Find the next character do_read() treats specially
+ * Args: Pointer to start of data, pointer to end of data
+ * Returns: Pointer to first '$', '!', '\\', '\r', '\n' or '\0' or the end
+ * pointer if there are none
+ * Where the processor supports it, data are checked 32 or 16 bytes at a
+ * time.  The last few bytes (or all of them otherwise) are looked up in
+ * delimtab one at a time
+ */
+static const char *delimscan(const char *bptr, const char *eptr)
+{
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    unsigned int m;
+#endif
+
+#if defined(__AVX2__)
+    for (;eptr-bptr >= 32;bptr+=32)
+        if ((m=delims32(bptr)) != 0)
+            return(bptr+__builtin_ctz(m));
+#endif
+#if defined(__SSE2__)
+    for (;eptr-bptr >= 16;bptr+=16)
+        if ((m=delims16(bptr)) != 0)
+            return(bptr+__builtin_ctz(m));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (;eptr-bptr >= 16;bptr+=16)
+        if ((m=delims16(bptr)) != 0)
+            /* Found in this block.  The loop below says where */
+            break;
+#endif
+    for (;bptr < eptr && !delimtab[(unsigned char) *bptr];bptr++);
+    return(bptr);
 }
 
 /* generic read routine
@@ -1223,27 +2180,45 @@ size_t gettag(iface_t *ifa, char *buf, senblk_t *sptr)
  */ 
 void do_read(iface_t *ifa)
 {
-    senblk_t sblk;
+    senblk_t *sptr=NULL;
+    iface_t *direct=NULL;
     char buf[BUFSIZ];
     char tbuf[TAGMAX];
     char *bptr,*eptr,*ptr;
-    int nread,countmax,count=0;
+    int nread,countmax,count=0,n;
     enum sstate senstate;
     int nocr=flag_test(ifa,F_NOCR)?1:0;
     int loose = (ifa->strict)?0:1;
-    sblk.src=ifa->id;
+    int cksum=ifa->checksum;
+    /* Checksum of the sentence so far */
+    int xsum=0;
     senstate=SEN_NODATA;
 
+    /* In direct dispatch mode we do the engine's work ourselves */
+    if (((struct if_engine *) ifa->lists->engine->info)->flags & K_DIRECT)
+        direct=ifa->lists->engine;
+
     while ((nread=(*ifa->readbuf)(ifa,buf)) > 0) {
         for(bptr=buf,eptr=buf+nread;bptr<eptr;bptr++) {
             switch (*bptr) {
             case '$':
             case '!':
-                ptr=sblk.data;
-                countmax=SENMAX-(nocr|loose);
+                /* Sentences are framed directly in a senblk for the queue.
+                 * One which isn't queued leaves it for the next */
+                if (sptr == NULL) {
+                    if ((sptr=reserve_senblk(ifa->q)) == NULL) {
+                        senstate=SEN_NODATA;
+                        continue;
+                    }
+                    sptr->src=ifa->id;
+                }
+                ptr=sptr->data;
+                countmax=ifa->senmax-(nocr|loose);
                 count=1;
                 *ptr++=*bptr;
                 senstate=SEN_SENPROC;
+                xsum=0;
+                sptr->nfields=0;
                 continue;
             case '\\':
                 if (senstate==SEN_TAGPROC) {
@@ -1260,11 +2235,11 @@ void do_read(iface_t *ifa)
             case '\r':
             case '\n':
             case '\0':
-                if (senstate == SEN_SENPROC || senstate == SEN_TAGSEEN) {
+                if (senstate == SEN_SENPROC) {
                     if (loose || (nocr && *bptr == '\n')) {
                         *ptr++='\r';
                         *ptr='\n';
-                        sblk.len = count+2;
+                        sptr->len = count+2;
                     } else {
                         if ((!nocr) && *bptr == '\r') {
                             senstate = SEN_CR;
@@ -1281,17 +2256,24 @@ void do_read(iface_t *ifa)
                         continue;
                     }
                     *ptr=*bptr;
-                    sblk.len = ++count;
+                    sptr->len = ++count;
                 } else {
                     senstate = SEN_NODATA;
                     continue;
                 }
+                index_end(sptr);
                 /* If we're not checksumming OR the checksum is correct OR
                  * it's a zero length packet, the first clause is false which
                  * is true when negated...*/
-                if (!(ifa->checksum && checkcksum(&sblk) && (sblk.len > 0 )) &&
-                        senfilter(&sblk,ifa->ifilter) == 0) {
-                    push_senblk(&sblk,ifa->q);
+                if (!(cksum && checkcksum_xor(sptr,xsum) &&
+                        (sptr->len > 0 )) && senfilter(sptr,ifa->ifilter) == 0) {
+                    if (direct == NULL)
+                        commit_senblk(sptr,ifa->q);
+                    else {
+                        dispatch(sptr,direct);
+                        senblk_release(sptr);
+                    }
+                    sptr=NULL;
                 }
                 senstate=SEN_NODATA;
                 continue;
@@ -1299,20 +2281,33 @@ void do_read(iface_t *ifa)
                 break;
             }
 
-            if (senstate != SEN_SENPROC && senstate != SEN_TAGPROC) {
-                if (senstate != SEN_NODATA )
-                    senstate=SEN_NODATA;
-                continue;
-            }
-
-            if (count++ > countmax) {
+            /* Deal with this and any following ordinary characters in one
+             * go */
+            n=delimscan(bptr,eptr)-bptr;
+            if ((senstate != SEN_SENPROC && senstate != SEN_TAGPROC) ||
+                    n > countmax+1-count) {
                 senstate=SEN_NODATA;
-                continue;
+            } else if (senstate == SEN_SENPROC &&
+                    count+n+2 > SENCAP(sptr) &&
+                    grow_senblk(&sptr,count,count+n+2,ifa->q) < 0) {
+                /* Longer than "senmax" allows but too long for us */
+                senstate=SEN_NODATA;
+            } else {
+                if (senstate == SEN_SENPROC)
+                    ptr=sptr->data+count;
+                memcpy(ptr,bptr,n);
+                if (cksum)
+                    xsum^=calcsum(bptr,n);
+                if (senstate == SEN_SENPROC)
+                    index_fields(sptr,ptr,ptr+n);
+                ptr+=n;
+                count+=n;
             }
-
-            *ptr++=*bptr;
+            bptr+=n-1;
         }
     }
+    if (sptr)
+        senblk_release(sptr);
     iface_thread_exit(errno);
 }
 
@@ -1374,6 +2369,7 @@ int main(int argc, char ** argv)
     struct iolists lists = {
         /* initialize io_mutex separately below */
         .init_mutex = PTHREAD_MUTEX_INITIALIZER,
+        .dispatch_mutex = PTHREAD_MUTEX_INITIALIZER,
         .init_cond = PTHREAD_COND_INITIALIZER,
         .dead_cond = PTHREAD_COND_INITIALIZER,
     .initialized = NULL,
@@ -1632,8 +2628,10 @@ int main(int argc, char ** argv)
          * interfaces where the initialisation routine has expanded them to an
          * IN/OUT pair.
          */
-            if (ifptr->direction == IN)
-                ifptr->q=engine->q;
+            if (ifptr->direction == IN && attach_input(ifptr) < 0) {
+                logerr(errno,"Failed to create queue for %s",ifptr->name);
+                exit(1);
+            }
 
             if (ifptr->checksum <0)
                 ifptr->checksum = engine->checksum;
@@ -1644,6 +2642,8 @@ int main(int argc, char ** argv)
                     ifptr->strict = (ifptr->type == FILEIO)?0:1;
                 }
             }
+            if (!ifptr->senmax)
+                ifptr->senmax = (engine->senmax)?engine->senmax:SENMAX;
             (*tiptr)=ifptr;
             tiptr=&ifptr->next;
             if (ifptr->next==ifptr2)
@@ -1658,6 +2658,24 @@ int main(int argc, char ** argv)
         if (ifptr->direction != IN && ifptr->ofilter)
             if (name2id(ifptr->ofilter))
                 logterm(errno,"Name to interface translation failed");
+        if (ifptr->direction != OUT && ifptr->ifilter)
+            if (name2id(ifptr->ifilter))
+                logterm(errno,"Name to interface translation failed");
+    }
+
+    /* Make sure threads can be placed and scheduled as requested before
+     * starting any */
+    if ((err=check_thread(&engine->sched)) != 0)
+        logterm(err,"Can't apply engine's cpus or sched option");
+    for (ifptr=lists.initialized;ifptr;ifptr=ifptr->next)
+        if ((err=check_thread(&ifptr->sched)) != 0)
+            logterm(err,"Can't apply cpus or sched option for %s",
+                    ifptr->name);
+
+    if (((struct if_engine *) engine->info)->flags & K_MLOCK) {
+        if (mlockall(MCL_CURRENT|MCL_FUTURE) < 0)
+            logterm(errno,"Failed to lock memory");
+        thrstack=THRSTACK;
     }
 
     /* Create the key for thread local storage: in this case for a pointer to
@@ -1698,15 +2716,31 @@ int main(int argc, char ** argv)
     pthread_sigmask(SIG_BLOCK, &set, NULL);
     sigdelset(&set,SIGUSR1);
     signal(SIGPIPE,SIG_IGN);
-    pthread_create(&tid,NULL,run_engine,(void *) engine);
+    if ((err=thread_create(&tid,&engine->sched,run_engine,(void *) engine))) {
+        logerr(err,"Failed to start engine");
+        for (ifptr=lists.initialized;ifptr;ifptr=ifptr2) {
+            ifptr2=ifptr->next;
+            iface_destroy(ifptr);
+        }
+        exit(1);
+    }
 
     pthread_mutex_lock(&lists.io_mutex);
-    for (ifptr=lists.initialized;ifptr;ifptr=ifptr->next) {
+    for (ifptr=lists.initialized;ifptr;ifptr=ifptr2) {
+        ifptr2=ifptr->next;
+        /* Create a thread to run each interface */
+        if ((err=thread_create(&tid,&ifptr->sched,(void *)start_interface,
+                (void *) ifptr)) != 0) {
+            /* Any pair is told to exit by free_if_data() */
+            logerr(err,"Failed to start %s",ifptr->name);
+            unlink_initialized(ifptr);
+            free_if_data(ifptr);
+            free(ifptr);
+            continue;
+        }
         /* Check we've got at least one input */
         if ((ifptr->direction == IN ) || (ifptr->direction == BOTH))
             gotinputs=1;
-        /* Create a thread to run each interface */
-        pthread_create(&tid,NULL,(void *)start_interface,(void *) ifptr);
     }
 
     while (lists.initialized)
@@ -1717,10 +2751,7 @@ int main(int argc, char ** argv)
      */
     if (!gotinputs) {
         logerr(0,"No Inputs!");
-        pthread_mutex_lock(&engine->q->q_mutex);
-        engine->q->active=0;
-        pthread_cond_broadcast(&engine->q->freshmeat);
-        pthread_mutex_unlock(&engine->q->q_mutex);
+        push_senblk(NULL,engine->q);
         timetodie++;
     }
 
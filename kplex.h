@@ -10,11 +10,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <termios.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #ifdef __APPLE__
 #include <AvailabilityMacros.h>
@@ -33,7 +37,10 @@
 #define DEFSRCNAME "kplex"
 
 #define DEFQSIZE 16
+/* Default time (ms) to wait for space on a full queue for overflow=block */
+#define DEFQBLOCK 1000
 
+/* Default maximum sentence length.  See the "senmax" option */
 #define SENMAX 80
 /* This should be +2. Will be reduced in a future release */
 #define SENBUFSZ (SENMAX + 4)
@@ -45,6 +52,13 @@
 #define MAXINTERFACES 65535
 
 #define BUFSIZE 1024
+/* Size of a cache line.  See struct senblk */
+#ifndef CACHELINE
+#define CACHELINE 64
+#endif
+#define CACHE_ALIGNED _Alignas(CACHELINE)
+/* Maximum number of sentences an output writes in one system call */
+#define WBATCH 32
 
 /* Iinterface flags */
 #define F_PERSIST 1
@@ -109,6 +123,14 @@ enum iotype {
     BOTH
 };
 
+/* What to do when a sentence is added to a full output queue */
+enum qpolicy {
+    Q_OLDEST,           /* drop the oldest queued sentence */
+    Q_NEWEST,           /* drop the new sentence */
+    Q_BLOCK,            /* wait for space, then drop the oldest sentence */
+    Q_CONFLATE          /* keep only the latest of each sentence type */
+};
+
 enum udptype {
     UDP_UNSPEC,
     UDP_UNICAST,
@@ -116,31 +138,165 @@ enum udptype {
     UDP_MULTICAST
 };
 
+/* Sentence priorities, which are also output queue lane numbers */
+#define PRIO_HIGH 0
+#define PRIO_NORMAL 1
+#define PRIO_LOW 2
+#define NPRIO 3
+
+/* Number of fields whose ends are recorded in a senblk.  See senfield() */
+#define MAXFIELDIDX 14
+/* A sentence's type code has the 5 characters after its start character one
+ * per byte, least significant first, and TYPE_SHORT set if the sentence ends
+ * among them.  An empty line, which filters always drop, also has TYPE_EMPTY
+ * set so that it doesn't share a type code with a sentence */
+#define TYPE_SHORT ((uint64_t) 1 << 63)
+#define TYPE_EMPTY ((uint64_t) 1 << 62)
+
+/* Sentence buffers are cache line aligned with a compact header so that
+ * the header and the start of the sentence share the first line.  Inputs
+ * index a sentence's fields as they frame it.  senblks come in NSENCLASS
+ * sizes, each twice the last.  The smallest, two cache lines, holds
+ * SENBUFSZ bytes of sentence and is all most sentences need */
 struct senblk {
-    size_t len;
-    unsigned long src;
-    struct senblk *next;
-    char data[SENBUFSZ];
+    CACHE_ALIGNED struct senblk *next;
+    atomic_int refs;
+    uint32_t src;               /* id of originating interface */
+    uint64_t type;              /* sentence type code */
+    uint16_t len;
+    uint16_t nfields;           /* number of fields, including the address */
+    unsigned char prio;
+    unsigned char cls;          /* size class */
+    unsigned char sep[MAXFIELDIDX]; /* offset of ',' or end of each field,
+                                     * 0 if beyond 255 */
+    char data[];
 };
 typedef struct senblk senblk_t;
 
+#define NSENCLASS 6
+#define SENCLASSZ(c) ((size_t) 2*CACHELINE << (c))
+/* Bytes of sentence a senblk can hold */
+#define SENCAP(sptr) (SENCLASSZ((sptr)->cls)-offsetof(struct senblk,data))
+/* Largest value of "senmax", leaving the same room as SENMAX does */
+#define MAXSENMAX (SENCLASSZ(NSENCLASS-1)-offsetof(struct senblk,data)- \
+        (SENBUFSZ-SENMAX))
+
+_Static_assert(SENCLASSZ(0)-offsetof(struct senblk,data) >= SENBUFSZ,
+        "smallest senblk too small for SENBUFSZ");
+
 typedef struct iface iface_t;
 
+/* A cell in a ring queue.  See queue.c */
+struct qcell {
+    atomic_size_t seq;
+    senblk_t *sblk;
+};
+
+/* A segment of a ring queue.  See queue.c */
+struct qring {
+    _Atomic(struct qring *) next;       /* segment written after this one */
+    size_t start;               /* first queue position held here */
+    size_t end;                 /* first position held in next segment */
+    size_t mask;                /* cells - 1 */
+    atomic_int done;            /* consumer has finished with this segment */
+    struct qcell cell[];
+};
+
+/* Something a thread can sleep on until another notifies it.  See queue.c */
+struct evcount {
+    atomic_uint seq;            /* advanced by notifications */
+    atomic_int waiters;         /* someone may be about to sleep */
+#ifndef __linux__
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+};
+
+/* A slot in a conflating queue.  See queue.c */
+struct cslot {
+    uint64_t type;              /* type code of "$" sentence, 0 if none */
+    senblk_t *sblk;
+};
+
+#define QNAMESZ 32
+
+/* Queue fields are grouped by who writes them */
 struct ioqueue {
-    iface_t *owner;
+    /* Set when the queue is created or rarely written */
+    struct ioqueue *next;       /* on list of queues waiting to be freed */
+    char name[QNAMESZ];         /* name of owning interface */
+    int mp;                     /* queue has multiple producers */
+    size_t size;                /* max sentences queued on the ring */
+    int elastic;                /* ring can grow and shrink */
+    size_t mincells;            /* smallest and largest segment sizes */
+    size_t maxcells;
+    enum qpolicy policy;
+    int blockms;                /* how long to wait for space on a full ring */
+    struct ioqueue *lane[NPRIO];        /* priority lanes (instead of ring) */
+    struct ioqueue *notify;     /* queue whose consumer takes from this one */
+    int weight;                 /* fair dispatch share */
+    atomic_int active;
+    atomic_int stalled;         /* Q_BLOCK timed out: drop oldest until the
+                                 * consumer finds the queue empty */
+    struct evcount room;        /* producer sleeps here when queue full */
     pthread_mutex_t    q_mutex;
-    pthread_cond_t    freshmeat;
-    int active;
-    int drops;
-    senblk_t *free;
-    senblk_t *qhead;
-    senblk_t *qtail;
-    senblk_t *base;
+    struct cslot *cslots;       /* conflating queue (instead of ring) */
+    size_t chead;               /* first slot in use */
+    atomic_size_t ccount;       /* number of slots in use */
+
+    /* Written by the consumer */
+    atomic_size_t head;         /* next position to be read */
+    struct qring *cons;         /* segment being read from */
+    long deficit;               /* bytes the engine may take this round */
+
+    /* Written by the producer(s) */
+    atomic_size_t tail;         /* next position to be written */
+    struct qring *prod;         /* segment being written to */
+    struct qring *ring;         /* oldest segment not yet freed */
+    size_t lowcount;            /* sentences added at low depth */
+    size_t peak;                /* greatest number of sentences queued */
+    atomic_int drops;
+
+    struct evcount ready;       /* consumer sleeps here when empty */
 };
 typedef struct ioqueue ioqueue_t;
 
+/* An output in a snapshot of the output list. See dispatch() */
+struct outent {
+    ioqueue_t *q;
+    unsigned long id;
+    int loopback;
+    struct sfilter *filter;     /* output filter applied by dispatch() */
+};
+
+/* Which outputs in a snapshot want sentences of a type from a source.
+ * See dispatch() */
+#define SUBCACHE 256
+struct subent {
+    uint64_t type;
+    uint32_t src;
+    uint32_t valid;
+    uint64_t want[];            /* bitmap of outputs by position */
+};
+
+struct outsnap {
+    struct outsnap *next;       /* on list of retired snapshots */
+    int n;
+    int words;                  /* size of subent bitmaps */
+    struct subent *sub;         /* SUBCACHE entries, NULL if not needed */
+    struct outent out[];
+};
+
 struct iolists {
     pthread_mutex_t io_mutex;
+    pthread_mutex_t dispatch_mutex;
+    _Atomic(struct outsnap *) snap;     /* current output list snapshot */
+    _Atomic(struct outsnap *) hazard;   /* snapshot in use by dispatch() */
+    struct outsnap *retired;
+    ioqueue_t *retiredq;
+    atomic_int reclaim;                 /* retired or retiredq not empty */
+    ioqueue_t *retiredin;               /* queues of departed inputs */
+    atomic_int inchanged;               /* input list has changed */
     pthread_mutex_t init_mutex;
     pthread_cond_t  dead_cond;
     pthread_cond_t  init_cond;
@@ -162,41 +318,115 @@ struct srclist {
     unsigned int  id;
     char *name;
     } src;
-    time_t failtime;
-    time_t lasttime;
+    uint64_t failtime;          /* ms */
+    uint64_t lasttime;          /* when last heard from (mono_ms()) */
+    int n;                      /* position in list: lower is preferred */
     struct srclist *next;
 };
 
+/* A failover rule's sources in order of failtime, indexed by id once names
+ * have been looked up.  See index_failover() */
+struct failover {
+    struct srclist *sources;
+    struct srclist *active;     /* source last passed, NULL if none yet */
+    size_t mask;                /* index entries - 1 */
+    struct srclist **index;     /* hash table of sources, NULL if not built */
+};
+
+/* A LIMIT rule's token bucket: up to burst sentences from each source may
+ * pass at once, then one per interval.  Buckets are kept per thread: see
+ * ratelimit() */
 struct ratelimit {
-    time_t timeout;
-    struct timeval last;
+    uint64_t interval;          /* ms per token */
+    unsigned int burst;         /* bucket size */
+    uint64_t gen;               /* unique to this rule, never 0 */
+};
+
+struct lbucket {
+    uint64_t gen;               /* rule's generation, 0 for an empty entry */
+    uint32_t src;
+    uint64_t tat;               /* when the bucket will be full (mono_ms()) */
+};
+
+struct lbuckets {
+    size_t mask;                /* table entries - 1 */
+    size_t used;
+    struct lbucket b[];
 };
 
 struct sfilter_rule {
     enum ruletype type;
     union { 
         struct ratelimit *limit;
-        struct srclist *source;
+        struct failover *failover;
     } info;
     union {
         unsigned int id;
         char *name;
     } src;
     char match[5];
+    uint64_t tmask;             /* match as a type code mask and value */
+    uint64_t tval;
     struct sfilter_rule *next;
 };
 
 typedef struct sfilter_rule sf_rule_t;
 
+/* Filter rules whose match strings have wildcards in the same places are in
+ * the same class.  5 characters, each wildcarded or not, makes 32 */
+#define NFCLASS 32
+
+/* A filter rule in a compiled filter's hash table */
+struct fentry {
+    uint64_t val;               /* rule's type code value */
+    uint32_t src;               /* rule's source, 0 for any */
+    int cls;                    /* rule's class, -1 for an empty entry */
+    int n;                      /* position of rule in filter */
+    sf_rule_t *rule;
+};
+
+/* A filter's rules indexed by class, type and source.  See compile_filter()
+ */
+struct fcompiled {
+    int ncls;
+    struct {
+        uint64_t mask;          /* type code mask of class's rules */
+        int first;              /* position of class's first rule */
+        unsigned char any;      /* class has rules for any source */
+        unsigned char bysrc;    /* class has rules for particular sources */
+    } cls[NFCLASS];
+    size_t mask;                /* table entries - 1 */
+    struct fentry ent[];
+};
+
 struct sfilter {
     enum filtertype type;
     pthread_mutex_t lock;
     unsigned int refcount;
     sf_rule_t *rules;
+    struct fcompiled *comp;     /* for FILTER filters with many rules */
+    int limits;                 /* number of LIMIT rules */
 };
 
 typedef struct sfilter sfilter_t;
 
+/* Highest numbered CPU a thread can be bound to, plus one */
+#define MAXCPUS 256
+
+/* Stack size for threads when memory is locked, so that each one doesn't
+ * lock the (typically 8MB) default.  See thread_create() */
+#define THRSTACK (256*1024)
+
+/* Where an interface's (or the engine's) thread runs and how it is
+ * scheduled.  See thread_create() */
+struct thrsched {
+    unsigned char cpus[MAXCPUS/8];      /* bitmap of CPUs to run on */
+    int ncpus;                  /* number of CPUs in bitmap, 0 for any */
+    int setsched;               /* policy and priority have been set */
+    int policy;                 /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int priority;
+};
+
 struct iface {
     pthread_t tid;
     unsigned long id;
@@ -211,6 +441,11 @@ struct iface {
     struct iolists *lists;
     int checksum;
     int strict;
+    int senmax;
+    int weight;
+    enum qpolicy qpolicy;
+    int qblock;
+    struct thrsched sched;
     unsigned int flags;
     unsigned int tagflags;
     sfilter_t *ifilter;
@@ -234,6 +469,9 @@ struct iftypedef {
 #define K_NOSTDIN 0x2
 #define K_NOSTDOUT 0x4
 #define K_NOSTDERR 0x8
+#define K_DIRECT 0x10
+#define K_FAIR 0x20
+#define K_MLOCK 0x40
 
 struct if_engine {
     unsigned flags;
@@ -262,18 +500,41 @@ void *ifdup_mcast(void *);
 void *ifdup_seatalk(void *);
 
 int init_q(iface_t *, size_t);
+int init_engine_q(iface_t *, size_t);
+void free_q(ioqueue_t *);
+int add_prio(char *, int);
+int init_ingress_q(iface_t *, ioqueue_t *);
+int ingress_wait(ioqueue_t *, ioqueue_t **, int, atomic_int *);
+void wake_q(ioqueue_t *);
+int attach_input(iface_t *);
+int sen_prio(senblk_t *);
 
 senblk_t *next_senblk(ioqueue_t *);
 senblk_t *last_senblk(ioqueue_t *);
+senblk_t *take_senblk(ioqueue_t *);
+int next_senblk_batch(ioqueue_t *, senblk_t **, int);
 void push_senblk(senblk_t *, ioqueue_t *);
+void push_senblk_ref(senblk_t *, ioqueue_t *);
+senblk_t *reserve_senblk(ioqueue_t *);
+int grow_senblk(senblk_t **, size_t, size_t, ioqueue_t *);
+void commit_senblk(senblk_t *, ioqueue_t *);
+senblk_t *senblk_alloc(size_t);
+void senblk_release(senblk_t *);
+senblk_t *senblk_copy(senblk_t *, senblk_t *);
 void senblk_free(senblk_t *, ioqueue_t *);
 void flush_queue(ioqueue_t *);
 int link_interface(iface_t *);
 int unlink_interface(iface_t *);
 int link_to_initialized(iface_t *);
+void unlink_initialized(iface_t *);
+void free_if_data(iface_t *);
 void start_interface(void *);
 iface_t *ifdup(iface_t *);
 void iface_thread_exit(int);
+int thread_create(pthread_t *, struct thrsched *, void *(*)(void *), void *);
+int check_thread(struct thrsched *);
+int parse_cpus(char *, struct thrsched *);
+int parse_sched(char *, struct thrsched *);
 int next_config(FILE *,unsigned int *,char **,char **);
 
 int calcsum(const char *, size_t);
@@ -282,6 +543,9 @@ iface_t *parse_arg(char *);
 iface_t *get_default_global(void);
 void free_options(struct kopts *);
 void free_filter(sfilter_t *);
+sfilter_t *getfilter(char *);
+char *getms(char *, uint64_t *);
+int name2id(sfilter_t *);
 void logerr(int,char *,...);
 void logterm(int,char *,...);
 void logtermall(int,char *,...);
@@ -291,7 +555,14 @@ void loginfo(char *,...);
 void initlog(int);
 sfilter_t *addfilter(sfilter_t *);
 int senfilter(senblk_t *,sfilter_t *);
+int addfailover(sfilter_t **,char *);
+int isactive(sfilter_t *,senblk_t *);
 int checkcksum(senblk_t *);
+int checkcksum_xor(senblk_t *, int);
+void senindex(senblk_t *);
+char *senfield(senblk_t *, int, size_t *);
+void rule_type(sf_rule_t *);
+int compile_filter(sfilter_t *);
 unsigned long namelookup(char *);
 char *idlookup(unsigned long);
 int insertname(char *, unsigned long);
@@ -299,6 +570,16 @@ void freenames(void);
 int cmdlineopt(struct kopts **, char *);
 void do_read(iface_t *);
 size_t gettag(iface_t *, char *, senblk_t *);
+uint64_t mono_ms(void);
+size_t tagtime(char *, int);
+void dispatch(senblk_t *, iface_t *);
+int publish_outputs(struct iolists *);
+int next_batch(iface_t *, senblk_t **, struct iovec *, char **);
+int writev_all(int, struct iovec *, int);
+int send_msgs(int, struct msghdr *, int);
+struct rbatch;
+ssize_t recv_msgs(int, struct rbatch **, char *,
+        int (*)(void *, struct sockaddr *, socklen_t), void *);
 
 extern struct iftypedef iftypes[];
 
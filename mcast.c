@@ -22,6 +22,7 @@ struct if_mcast {
         struct ip_mreq ipmr;
         struct ipv6_mreq ip6mr;
     } mr;
+    struct rbatch *rbatch;
 };
 
 /*
@@ -40,6 +41,7 @@ void *ifdup_mcast(void *ifb)
         return(NULL);
 
     (void) memcpy(newif, oldif, sizeof(struct if_mcast));
+    newif->rbatch = NULL;
 
     return((void *) newif);
 }
@@ -59,6 +61,9 @@ void cleanup_mcast(iface_t *ifa)
         }
     }
 
+    if (ifb->rbatch)
+        free(ifb->rbatch);
+
     /* iomutex should be locked in the cleanup routine */
     if (!ifa->pair)
         close(ifb->fd);
@@ -67,10 +72,12 @@ void cleanup_mcast(iface_t *ifa)
 void write_mcast(struct iface *ifa)
 {
     struct if_mcast *ifb;
-    senblk_t *sptr;
-    int data=0;
-    struct msghdr msgh;
-    struct iovec iov[2];
+    senblk_t *sv[WBATCH];
+    struct iovec tv[WBATCH];
+    struct iovec iov[2*WBATCH];
+    struct msghdr msgh,mv[WBATCH];
+    char *tbuf=NULL;
+    int i,n,err;
 
     ifb = (struct if_mcast *) ifa->info;
 
@@ -78,49 +85,40 @@ void write_mcast(struct iface *ifa)
     msgh.msg_namelen=ifb->asize;
     msgh.msg_control=NULL;
     msgh.msg_controllen=msgh.msg_flags=0;
-    msgh.msg_iov=iov;
-    msgh.msg_iovlen=1;
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*WBATCH)) == NULL) {
                 logerr(errno,"Disabing tag output on interface id %u (%s)",
                         ifa->id,(ifa->name)?ifa->name:"unlabelled");
                 ifa->tagflags=0;
-        } else {
-            msgh.msg_iovlen=2;
-            data=1;
         }
     }
 
     for (;;) {
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n = next_batch(ifa,sv,tv,&tbuf)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
+        for (i=0;i<n;i++) {
+            mv[i]=msgh;
+            mv[i].msg_iov=iov+2*i;
+            mv[i].msg_iovlen=0;
+            if (tv[i].iov_len)
+                iov[2*i+mv[i].msg_iovlen++]=tv[i];
+            iov[2*i+mv[i].msg_iovlen].iov_base=sv[i]->data;
+            iov[2*i+mv[i].msg_iovlen++].iov_len=sv[i]->len;
         }
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
-                ifa->tagflags=0;
-                msgh.msg_iovlen=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
+        err=send_msgs(ifb->fd,mv,n);
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
+        for (i=0;i<n;i++)
+            senblk_free(sv[i],ifa->q);
 
-        if (sendmsg(ifb->fd,&msgh,0) < 0)
+        if (err)
             break;
-        senblk_free(sptr,ifa->q);
     }
 
-    if (ifa->tagflags)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
@@ -128,10 +126,8 @@ void write_mcast(struct iface *ifa)
 ssize_t read_mcast(iface_t *ifa, char *buf)
 {
     struct if_mcast *ifm = (struct if_mcast *) ifa->info;
-    struct sockaddr_storage src;
-    socklen_t sz = (socklen_t) sizeof(src);
 
-    return recvfrom(ifm->fd,(void *)buf,BUFSIZ,0,(struct sockaddr *) &src,&sz);
+    return(recv_msgs(ifm->fd,&ifm->rbatch,buf,NULL,NULL));
 }
 
 /* Check whether an address is multicast
@@ -182,7 +178,7 @@ struct iface *init_mcast(struct iface *ifa)
     int on=1,off=0;
     int err;
     
-    if ((ifm=malloc(sizeof(struct if_mcast))) == NULL) {
+    if ((ifm=calloc(1,sizeof(struct if_mcast))) == NULL) {
         logerr(errno,"Could not allocate memory");
         return(NULL);
     }
@@ -229,6 +229,50 @@ struct kopts *add_option(char *var, char *val)
     return(vv);
 }
 
+/*
+ * Read a number of seconds with up to 3 decimal places (any more are
+ * ignored)
+ * Args: string, pointer to where to put the number of milliseconds
+ * Returns: pointer to the first character after the number
+ */
+char *getms(char *str, uint64_t *ms)
+{
+    int i;
+
+    for (*ms=0;*str >= '0' && *str <= '9';str++)
+        *ms=*ms*10+*str-'0';
+    *ms*=1000;
+    if (*str == '.')
+        for (i=100,str++;*str >= '0' && *str <= '9';str++,i/=10)
+            *ms+=(*str-'0')*i;
+    return(str);
+}
+
+/*
+ * Parse the options of a LIMIT filter rule: the minimum interval in
+ * seconds between sentences, optionally followed by a comma and the number
+ * which may be passed in a burst
+ * Args: string following FILTEROPTDELIM, pointer to structure to fill in
+ * Returns: pointer to the first character after the options, NULL if
+ * they are invalid
+ */
+static char *getlimit(char *fstring, struct ratelimit *limit)
+{
+    fstring=getms(fstring,&limit->interval);
+
+    if (*fstring == ',') {
+        for (limit->burst=0;*++fstring >= '0' && *fstring <= '9';)
+            limit->burst=limit->burst*10+*fstring-'0';
+        if (limit->burst == 0)
+            return(NULL);
+    }
+    return(fstring);
+}
+
+/* Generation numbers for LIMIT rules, so that rate limit buckets are never
+ * shared by a rule and a later one which happens to reuse its memory */
+static uint64_t limitgen;
+
 sfilter_t *getfilter(char *fstring)
 {
     char *sptr;
@@ -257,7 +301,9 @@ sfilter_t *getfilter(char *fstring)
                 break;
             }
             tfilter->type=LIMIT;
-            memset(tfilter->info.limit,0,sizeof(struct ratelimit));
+            tfilter->info.limit->interval=0;
+            tfilter->info.limit->burst=1;
+            tfilter->info.limit->gen=++limitgen;
         } else
             break;
 
@@ -273,6 +319,7 @@ sfilter_t *getfilter(char *fstring)
                 *sptr++=(*fstring == '*')?0:*fstring;
             }
         }
+        rule_type(tfilter);
 
         if (*fstring == FILTERSRCDELIM) {
             sptr=++fstring;
@@ -285,13 +332,8 @@ sfilter_t *getfilter(char *fstring)
 
         if (*fstring == FILTEROPTDELIM) {
             if (tfilter->type == LIMIT) {
-                while(*++fstring) {
-                    if (*fstring >= '0' && *fstring <= '9') 
-                        tfilter->info.limit->timeout =
-                                tfilter->info.limit->timeout*10 + *fstring - '0';
-                    else
-                        break;
-                }
+                if ((fstring=getlimit(fstring+1,tfilter->info.limit)) == NULL)
+                    break;
             } else {
                 break;
             }
@@ -300,31 +342,121 @@ sfilter_t *getfilter(char *fstring)
         if ((*fstring == FILTERDELIM) || (*fstring == '\0')) {
             (*fptr)=tfilter;
             fptr=&tfilter->next;
+            tfilter=NULL;
             ok=1;
             if (*fstring == '\0')
                 break;
         } else
             break;
     }
+    /* Rules are indexed by name2id() once their source ids are known */
     if (ok) {
         if ((head=(sfilter_t *)malloc(sizeof(sfilter_t))) != NULL) {
             head->type=FILTER;
             pthread_mutex_init(&head->lock,NULL);
             head->refcount=1;
             head->rules=filter;
+            head->comp=NULL;
+            head->limits=0;
             return(head);
         }
+    } else if (tfilter) {
+        /* The rule being parsed isn't on the list yet */
+        tfilter->next=filter;
+        filter=tfilter;
     }
 
-    if (tfilter)
-        free(tfilter);
     for(;filter;filter=tfilter) {
         tfilter=filter->next;
+        if (filter->src.name)
+            free(filter->src.name);
+        if (filter->type == LIMIT)
+            free(filter->info.limit);
         free(filter);
     }
     return(NULL);
 }
 
+/*
+ * Parse a list of CPUs for an interface's (or the engine's) thread to run on
+ * Args: comma separated list of CPU numbers and ranges (e.g. "0,2-3"),
+ * scheduling options to set the list in
+ * Returns: 0 on success, -1 on failure
+ * Only supported on Linux
+ */
+int parse_cpus(char *val, struct thrsched *ts)
+{
+#ifdef __linux__
+    char *ptr;
+    long first,last;
+
+    memset(ts->cpus,0,sizeof(ts->cpus));
+    ts->ncpus=0;
+    for (;;) {
+        first=last=strtol(val,&ptr,10);
+        if (ptr == val || first < 0)
+            return(-1);
+        if (*ptr == '-') {
+            val=ptr+1;
+            last=strtol(val,&ptr,10);
+            if (ptr == val || last < first)
+                return(-1);
+        }
+        if (last >= MAXCPUS)
+            return(-1);
+        for (;first <= last;first++)
+            if (!(ts->cpus[first/8] & (1 << (first%8)))) {
+                ts->cpus[first/8] |= 1 << (first%8);
+                ts->ncpus++;
+            }
+        if (*ptr == '\0')
+            return(0);
+        if (*ptr != ',')
+            return(-1);
+        val=ptr+1;
+    }
+#else
+    return(-1);
+#endif
+}
+
+/*
+ * Parse a scheduling policy and priority for an interface's (or the
+ * engine's) thread
+ * Args: "other", "fifo:<priority>" or "rr:<priority>", scheduling options
+ * to set
+ * Returns: 0 on success, -1 on failure
+ */
+int parse_sched(char *val, struct thrsched *ts)
+{
+    char *ptr;
+    int policy;
+    long prio=0;
+
+    if (!strcasecmp(val,"other"))
+        policy=SCHED_OTHER;
+    else if (!strncasecmp(val,"fifo:",5)) {
+        policy=SCHED_FIFO;
+        val+=5;
+    } else if (!strncasecmp(val,"rr:",3)) {
+        policy=SCHED_RR;
+        val+=3;
+    } else
+        return(-1);
+
+    if (policy != SCHED_OTHER) {
+        prio=strtol(val,&ptr,10);
+        if (ptr == val || *ptr || prio < sched_get_priority_min(policy) ||
+                prio > sched_get_priority_max(policy))
+            return(-1);
+    }
+
+    ts->setsched=1;
+    ts->policy=policy;
+    ts->priority=(int) prio;
+    return(0);
+}
+
 int add_common_opt(char *var, char *val,iface_t *ifp)
 {
     char *ptr;
@@ -412,6 +544,35 @@ int add_common_opt(char *var, char *val,iface_t *ifp)
             flag_clear(ifp,F_NOCR);
         } else
             return(-2);
+    } else if (!strcmp(var,"weight")) {
+        if (ifp->type == GLOBAL || (ifp->weight=atoi(val)) <= 0)
+            return(-2);
+    } else if (!strcmp(var,"senmax")) {
+        if ((ifp->senmax=atoi(val)) <= 0 || ifp->senmax > MAXSENMAX)
+            return(-2);
+    } else if (!strcmp(var,"cpus")) {
+        if (parse_cpus(val,&ifp->sched) < 0)
+            return(-2);
+    } else if (!strcmp(var,"sched")) {
+        if (parse_sched(val,&ifp->sched) < 0)
+            return(-2);
+    } else if (!strcmp(var,"overflow")) {
+        if (ifp->type == GLOBAL)
+            return(-2);
+        if (!strcasecmp(val,"oldest")) {
+            ifp->qpolicy=Q_OLDEST;
+        } else if (!strcasecmp(val,"newest")) {
+            ifp->qpolicy=Q_NEWEST;
+        } else if (!strcasecmp(val,"conflate")) {
+            ifp->qpolicy=Q_CONFLATE;
+        } else if (!strncasecmp(val,"block",5)) {
+            ifp->qpolicy=Q_BLOCK;
+            if (val[5] == '\0')
+                ifp->qblock=DEFQBLOCK;
+            else if (val[5] != ':' || (ifp->qblock=atoi(val+6)) <= 0)
+                return(-2);
+        } else
+            return(-2);
     } else if (!strcasecmp(var,"name")) {
         if ((ifp->name=(char *)malloc(strlen(val)+1)) == NULL)
             return(-1);
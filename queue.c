@@ -0,0 +1,1526 @@
+/* queue.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2019
+ * For copying information see the file COPYING distributed with this software
+ *
+ * This file contains the ioqueue routines used to pass sentences between
+ * interface threads and the multiplexing engine.
+ *
+ * Queues are lock-free rings with a single consumer.  Output queues have
+ * exactly one producer (the engine).  The engine's queue is written to by
+ * every input and so is initialised for multiple producers, which claim
+ * positions at the tail with a compare and swap.
+ *
+ * Each ring cell carries a sequence number.  A cell with sequence number n is
+ * free for a producer to write queue position n into.  Once written its
+ * sequence is set to n+1, marking it ready for the consumer.  When position n
+ * is removed from the queue, its cell's sequence is advanced to n plus the
+ * ring size so it can be re-used on the next lap.
+ *
+ * To preserve the "drop oldest" behaviour of list queues, a producer which
+ * finds the ring full removes the entry at the head of the queue itself.
+ * Producers and consumer therefore all claim entries from the head with a
+ * compare and swap.
+ *
+ * Rings hold pointers to reference counted senblks from a shared pool.  An
+ * input frames each sentence directly in a pool senblk it has reserved with
+ * reserve_senblk() and hands it to the engine's queue with commit_senblk().
+ * The engine then adds a reference to that same senblk to each output's
+ * queue.  Whoever takes a senblk from a queue owns that
+ * reference and gives it up with senblk_free().  The last reference returns
+ * the senblk to the pool.
+ *
+ * The pool keeps a small per-thread cache of free senblks.  Inputs allocate
+ * and outputs release, so caches exchange batches of senblks with a global
+ * free list protected by pool_mutex.  When both are empty a cache is
+ * refilled with a new slab of senblks.  senblks come in size classes, each
+ * with its own caches and free list.  An input starts every sentence in the
+ * smallest and moves it with grow_senblk() only if it outgrows that, so
+ * a long sentence's memory goes back to the pool with the sentence rather
+ * than every senblk being as big as the longest allowed.  Class sizes are
+ * powers of two so that slabs stay aligned.  senblks are cache line
+ * aligned (see kplex.h).
+ *
+ * A consumer which finds its queue empty polls it briefly then sleeps on
+ * the queue's "ready" eventcount.  Producers notify the eventcount after
+ * adding to the queue, which costs a fence and a load unless the consumer
+ * has announced that it is going to sleep, so a writer which is keeping up
+ * never causes its producer to make a system call.
+ *
+ * Output rings are elastic.  "qsize" is a ceiling rather than an allocation:
+ * a ring starts with a small number of cells.  When the engine finds it more
+ * than 3/4 full it starts writing to a new segment with twice as many cells,
+ * linked after the current one.  Once at least a ring's worth of sentences
+ * have been added while it has been no more than 1/8 full, it moves to a
+ * segment half the size.
+ * Positions are not affected by this: the consumer moves on to the next
+ * segment when it reaches the position at which the engine started writing
+ * there, and marks the old one done.  Only the engine frees segments, and
+ * only once they're done, so a segment is never freed while anyone else
+ * could be using it.  The engine's queue has multiple producers and stays
+ * in a single segment.
+ *
+ * An output's "overflow" option selects what happens when the engine adds
+ * a sentence to a full queue.  By default the oldest sentence is dropped as
+ * described above.  Alternatively the new sentence can be dropped, or the
+ * engine can wait a limited time for the writer to make space before doing
+ * so.  A waiting engine sleeps on the queue's "room" eventcount.
+ *
+ * If the global "highprio" or "lowprio" options are used, output queues
+ * with the default overflow policy have a ring for each sentence priority
+ * ("lanes") instead of a single ring.  Each sentence's priority is looked up
+ * once, when the engine dispatches it.  The writer always takes from the
+ * highest priority lane with anything in it.  Lanes share the queue's qsize:
+ * a sentence added to a full queue displaces the oldest sentence in the
+ * lowest priority lane which isn't empty, unless that is of higher priority
+ * than the new sentence, in which case the new sentence is dropped.
+ *
+ * In fair dispatch mode each input has its own single producer "ingress"
+ * queue.  The engine is the consumer of all of them.  Rather than having its
+ * own sleeping consumer, an ingress queue wakes the engine's through its
+ * "notify" pointer.
+ *
+ * Conflating queues don't use a ring.  They hold at most one sentence for
+ * each combination of start character, talker and sentence type.  A new
+ * sentence replaces any queued sentence of the same type in its place in
+ * the queue, so a slow output always gets the latest of each type rather
+ * than a backlog of whichever type is sent most often.  AIS ("!") sentences
+ * are never conflated as each one carries different information.
+ * Conflating queues are protected by q_mutex.  Their consumer can see
+ * whether there is anything queued without taking it.
+ */
+
+#include "kplex.h"
+#include <sys/time.h>
+#include <time.h>
+#ifdef __linux__
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/* Number of times a producer re-checks a cell which isn't yet free (because
+ * the consumer is still taking from it or another producer is still
+ * writing to the head of a full ring) before giving up and dropping the new
+ * sentence instead */
+#define QSPINS 128
+
+/* Number of times a consumer polls an empty queue before going to sleep */
+#define QPARKSPINS 100
+
+/* Let the processor know we're spinning */
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+/* Number of cells in a new elastic ring, if qsize is no smaller */
+#define QMINCELLS 16
+
+/* Minimum number of consecutive sentences which must be added to an elastic
+ * ring while it is at or below its low watermark before it is shrunk.  No
+ * fewer than the ring has cells are needed either */
+#define QSHRINKAFTER 256
+
+/* Maximum number of free senblks of the smallest size class cached by each
+ * thread.  Half this many are moved to or from the global free list at a
+ * time.  Each larger class caches half as many as the one before */
+#define POOLCACHE 64
+#define CACHEMAX(c) (POOLCACHE>>(c))
+
+/* Number of senblks of the smallest class allocated at once when the pool
+ * is empty.  Again, half as many for each larger class */
+#define SLABSIZE (POOLCACHE/2)
+#define SLABN(c) (SLABSIZE>>(c))
+
+_Static_assert(SLABN(NSENCLASS-1) >= 1,"too many senblk size classes");
+
+struct senpool {
+    senblk_t *free[NSENCLASS];
+    int count[NSENCLASS];
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static senblk_t *pool_free[NSENCLASS];
+
+/* Sentence types with a priority other than PRIO_NORMAL.  See add_prio() */
+struct prioent {
+    uint64_t mask;              /* type code mask and value to match */
+    uint64_t val;
+    int prio;
+};
+
+static struct prioent *priotab;
+static int npriotab;
+
+/*
+ * Return all senblks in a thread's pool cache to the global free lists
+ * Args: pointer to thread's cache (cast to void *)
+ * Returns: Nothing
+ * Called on thread exit
+ */
+static void pool_cache_exit(void *arg)
+{
+    struct senpool *cache = (struct senpool *) arg;
+    senblk_t *sptr;
+    int c;
+
+    for (c=0;c<NSENCLASS;c++) {
+        if ((sptr=cache->free[c]) == NULL)
+            continue;
+        while (sptr->next)
+            sptr=sptr->next;
+        pthread_mutex_lock(&pool_mutex);
+        sptr->next=pool_free[c];
+        pool_free[c]=cache->free[c];
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    free(cache);
+}
+
+static void pool_init(void)
+{
+    (void) pthread_key_create(&pool_key,pool_cache_exit);
+}
+
+/*
+ * Allocate a slab of senblks
+ * Args: Size class, pointer to free list to add all but the first senblk
+ * to, pointer to a count of senblks on that list (or NULL)
+ * Returns: Pointer to the first senblk in the slab, or NULL if memory
+ * could not be allocated
+ * Slabs are cache line aligned and never freed: their senblks are returned
+ * to the pool, which is shared by all queues
+ */
+static senblk_t *slab_alloc(int c, senblk_t **list, int *count)
+{
+    char *slab;
+    senblk_t *sptr;
+    int i;
+
+    if (posix_memalign((void **) &slab,CACHELINE,SLABN(c)*SENCLASSZ(c)))
+        return(NULL);
+
+    for (i=SLABN(c)-1;i >= 0;i--) {
+        sptr=(senblk_t *) (slab+i*SENCLASSZ(c));
+        sptr->cls=c;
+        if (i) {
+            sptr->next=*list;
+            *list=sptr;
+        }
+    }
+    if (count)
+        *count+=SLABN(c)-1;
+    return(sptr);
+}
+
+/*
+ * Get this thread's pool cache, creating it if necessary
+ * Args: None
+ * Returns: pointer to cache or NULL if one could not be created
+ */
+static struct senpool *pool_cache(void)
+{
+    struct senpool *cache;
+
+    (void) pthread_once(&pool_once,pool_init);
+    if ((cache=(struct senpool *)pthread_getspecific(pool_key)) == NULL) {
+        if ((cache=(struct senpool *)calloc(1,sizeof(struct senpool)))
+                == NULL)
+            return(NULL);
+        if (pthread_setspecific(pool_key,cache) != 0) {
+            free(cache);
+            return(NULL);
+        }
+    }
+    return(cache);
+}
+
+/*
+ * Allocate a senblk from the pool
+ * Args: Number of bytes of sentence it must be able to hold
+ * Returns: pointer to a senblk of the smallest size class which will do
+ * with a reference count of 1, or NULL if memory could not be allocated
+ * or the size is more than the largest class holds
+ */
+senblk_t *senblk_alloc(size_t len)
+{
+    struct senpool *cache;
+    senblk_t *sptr;
+    int c;
+
+    for (c=0;SENCLASSZ(c)-offsetof(senblk_t,data) < len;)
+        if (++c == NSENCLASS)
+            return(NULL);
+
+    if ((cache=pool_cache()) == NULL) {
+        pthread_mutex_lock(&pool_mutex);
+        if ((sptr=pool_free[c]) != NULL)
+            pool_free[c]=sptr->next;
+        else
+            sptr=slab_alloc(c,&pool_free[c],NULL);
+        pthread_mutex_unlock(&pool_mutex);
+    } else {
+        if (cache->free[c] == NULL) {
+            /* Refill half the cache from the global list */
+            pthread_mutex_lock(&pool_mutex);
+            while (pool_free[c] && cache->count[c] < CACHEMAX(c)/2) {
+                sptr=pool_free[c];
+                pool_free[c]=sptr->next;
+                sptr->next=cache->free[c];
+                cache->free[c]=sptr;
+                cache->count[c]++;
+            }
+            pthread_mutex_unlock(&pool_mutex);
+        }
+        if ((sptr=cache->free[c]) != NULL) {
+            cache->free[c]=sptr->next;
+            cache->count[c]--;
+        } else
+            sptr=slab_alloc(c,&cache->free[c],&cache->count[c]);
+    }
+
+    if (sptr == NULL)
+        return(NULL);
+
+    sptr->next=NULL;
+    sptr->prio=PRIO_NORMAL;
+    atomic_init(&sptr->refs,1);
+    return(sptr);
+}
+
+/*
+ * Give up a reference to a pool senblk, returning it to the pool if it was
+ * the last one
+ * Args: pointer to senblk
+ * Returns: Nothing
+ */
+void senblk_release(senblk_t *sptr)
+{
+    struct senpool *cache;
+    senblk_t *tptr;
+    int c=sptr->cls;
+
+    if (atomic_fetch_sub_explicit(&sptr->refs,1,memory_order_acq_rel) != 1)
+        return;
+
+    if ((cache=pool_cache()) == NULL) {
+        pthread_mutex_lock(&pool_mutex);
+        sptr->next=pool_free[c];
+        pool_free[c]=sptr;
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+
+    sptr->next=cache->free[c];
+    cache->free[c]=sptr;
+    if (++cache->count[c] < CACHEMAX(c))
+        return;
+
+    /* Cache full: return half of it to the global list */
+    for (tptr=cache->free[c];--cache->count[c] > CACHEMAX(c)/2;
+            tptr=tptr->next);
+    pthread_mutex_lock(&pool_mutex);
+    sptr=tptr->next;
+    tptr->next=pool_free[c];
+    pool_free[c]=cache->free[c];
+    pthread_mutex_unlock(&pool_mutex);
+    cache->free[c]=sptr;
+}
+
+/*
+ * Give a list of sentence types a priority
+ * Args: colon separated list of sentence types, each either 3 characters
+ * (e.g. "HDG") or 5 including the talker (e.g. "GPRMC"), and priority
+ * Returns: 0 on success, -1 on failure
+ * Must be called before any output queues are created.  Where a sentence
+ * matches more than one type, the first given wins
+ */
+int add_prio(char *val, int prio)
+{
+    struct prioent *tab;
+    char *ptr;
+    size_t len,i;
+
+    for (;;) {
+        for (ptr=val;*ptr && *ptr != ':';ptr++);
+        if ((len=ptr-val) != 3 && len != 5) {
+            errno=EINVAL;
+            return(-1);
+        }
+        if ((tab=(struct prioent *) realloc(priotab,(npriotab+1)*
+                sizeof(struct prioent))) == NULL)
+            return(-1);
+        priotab=tab;
+        /* A 3 character type matches the last 3 of the address field */
+        for (tab+=npriotab,tab->mask=tab->val=0,i=len;i;i--) {
+            tab->mask=(tab->mask<<8)|0xff;
+            tab->val=(tab->val<<8)|(unsigned char) val[i-1];
+        }
+        tab->mask<<=8*(5-len);
+        tab->val<<=8*(5-len);
+        tab->prio=prio;
+        npriotab++;
+        if (*ptr == '\0')
+            return(0);
+        val=ptr+1;
+    }
+}
+
+/*
+ * Look up the priority of a sentence
+ * Args: Pointer to senblk
+ * Returns: Sentence priority
+ */
+int sen_prio(senblk_t *sptr)
+{
+    struct prioent *ent;
+    int i;
+
+    if (npriotab == 0 || sptr->len < 7)
+        return(PRIO_NORMAL);
+
+    for (i=0,ent=priotab;i<npriotab;i++,ent++)
+        if ((sptr->type & ent->mask) == ent->val)
+            return(ent->prio);
+    return(PRIO_NORMAL);
+}
+
+/*
+ * Allocate a ring segment
+ * Args: Number of cells (a power of 2), first position it is to hold
+ * Returns: Pointer to new segment or NULL on failure
+ */
+static struct qring *ring_alloc(size_t cells, size_t start)
+{
+    struct qring *r;
+    size_t i;
+
+    if ((r=(struct qring *) malloc(sizeof(struct qring)+
+            cells*sizeof(struct qcell))) == NULL)
+        return(NULL);
+
+    atomic_init(&r->next,NULL);
+    atomic_init(&r->done,0);
+    r->start=r->end=start;
+    r->mask=cells-1;
+    /* Each cell is initially free for the first position at or after start
+     * which maps to it */
+    for (i=0;i<cells;i++)
+        atomic_init(&r->cell[i].seq,start+((i-start) & r->mask));
+    return(r);
+}
+
+/*
+ * Eventcounts
+ * A thread which wants to sleep until some condition is true gets a key
+ * with ec_prepare(), checks the condition again and, if it is still false,
+ * calls ec_wait() with the key.  ec_wait() returns once the count has moved
+ * on from the key (or sooner: callers always re-check).  Whoever makes the
+ * condition true calls ec_notify() afterwards.  That only advances the count
+ * and wakes sleepers if someone has announced they are waiting, so it is
+ * cheap when nobody is.  Every eventcount here has at most one waiter, so
+ * the first notification clears the announcement and any more before the
+ * waiter runs again cost nothing.  ec_wake() always wakes a sleeper, for
+ * use when what changed isn't something the waiter checks with ec_prepare()
+ * On Linux sleepers wait on the count itself with a futex.  Elsewhere a
+ * mutex and condition variable are used.
+ */
+
+/*
+ * Initialise an eventcount
+ * Args: Pointer to eventcount
+ * Returns: Nothing
+ */
+static void ec_init(struct evcount *ec)
+{
+    atomic_init(&ec->seq,0);
+    atomic_init(&ec->waiters,0);
+#ifndef __linux__
+    pthread_mutex_init(&ec->mutex,NULL);
+    pthread_cond_init(&ec->cond,NULL);
+#endif
+}
+
+/*
+ * Free resources associated with an eventcount
+ * Args: Pointer to eventcount
+ * Returns: Nothing
+ */
+static void ec_destroy(struct evcount *ec)
+{
+#ifndef __linux__
+    pthread_mutex_destroy(&ec->mutex);
+    pthread_cond_destroy(&ec->cond);
+#endif
+}
+
+/*
+ * Announce an intention to wait on an eventcount
+ * Args: Pointer to eventcount
+ * Returns: Key to pass to ec_wait()
+ * The caller must check its wait condition after this and call ec_cancel()
+ * if it decides not to wait
+ */
+static unsigned ec_prepare(struct evcount *ec)
+{
+    unsigned key;
+
+    key=atomic_load_explicit(&ec->seq,memory_order_acquire);
+    atomic_store_explicit(&ec->waiters,1,memory_order_relaxed);
+    /* Pairs with the fence in ec_notify(): either the notifier sees that
+     * we're waiting or we see whatever it did before notifying */
+    atomic_thread_fence(memory_order_seq_cst);
+    return(key);
+}
+
+/*
+ * Withdraw an intention to wait on an eventcount
+ * Args: Pointer to eventcount
+ * Returns: Nothing
+ */
+static void ec_cancel(struct evcount *ec)
+{
+    atomic_store_explicit(&ec->waiters,0,memory_order_relaxed);
+}
+
+#ifndef __linux__
+/*
+ * Unlock an eventcount's mutex.  Cleanup handler for threads waiting on its
+ * condition variable: interface threads are shut down with pthread_exit()
+ * from a signal handler, which re-acquires the mutex on the way out of
+ * pthread_cond_wait()
+ * Args: Pointer to eventcount (cast to void *)
+ * Returns: Nothing
+ */
+static void ec_unlock(void *arg)
+{
+    pthread_mutex_unlock(&((struct evcount *) arg)->mutex);
+}
+#endif
+
+/*
+ * Sleep on an eventcount until it moves on from a key
+ * Args: Pointer to eventcount, key from ec_prepare(), maximum time to wait
+ * in milliseconds (negative to wait indefinitely)
+ * Returns: Nothing
+ * May return early.  Callers re-check their wait condition
+ */
+static void ec_wait(struct evcount *ec, unsigned key, long ms)
+{
+#ifdef __linux__
+    struct timespec ts,*tp=NULL;
+
+    if (ms >= 0) {
+        ts.tv_sec=ms/1000;
+        ts.tv_nsec=(ms%1000)*1000000;
+        tp=&ts;
+    }
+    (void) syscall(SYS_futex,(void *) &ec->seq,FUTEX_WAIT_PRIVATE,key,tp,
+            NULL,0);
+#else
+    struct timeval tv;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ec->mutex);
+    pthread_cleanup_push(ec_unlock,ec);
+    if (atomic_load_explicit(&ec->seq,memory_order_relaxed) == key) {
+        if (ms < 0)
+            pthread_cond_wait(&ec->cond,&ec->mutex);
+        else {
+            (void) gettimeofday(&tv,NULL);
+            ts.tv_sec=tv.tv_sec+ms/1000;
+            ts.tv_nsec=tv.tv_usec*1000+(ms%1000)*1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec-=1000000000;
+            }
+            (void) pthread_cond_timedwait(&ec->cond,&ec->mutex,&ts);
+        }
+    }
+    pthread_cleanup_pop(1);
+#endif
+}
+
+/*
+ * Advance an eventcount and wake anything sleeping on it
+ * Args: Pointer to eventcount
+ * Returns: Nothing
+ */
+static void ec_wake(struct evcount *ec)
+{
+#ifdef __linux__
+    atomic_fetch_add(&ec->seq,1);
+    (void) syscall(SYS_futex,(void *) &ec->seq,FUTEX_WAKE_PRIVATE,INT_MAX,
+            NULL,NULL,0);
+#else
+    pthread_mutex_lock(&ec->mutex);
+    atomic_fetch_add(&ec->seq,1);
+    pthread_cond_broadcast(&ec->cond);
+    pthread_mutex_unlock(&ec->mutex);
+#endif
+}
+
+/*
+ * Wake anything waiting on an eventcount, if there is anything
+ * Args: Pointer to eventcount
+ * Returns: Nothing
+ * Called after making a waiter's condition true
+ */
+static void ec_notify(struct evcount *ec)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ec->waiters,memory_order_relaxed) &&
+            atomic_exchange_explicit(&ec->waiters,0,memory_order_relaxed))
+        ec_wake(ec);
+}
+
+static void q_free(ioqueue_t *);
+
+/*
+ *  Create an ioqueue
+ *  Args: Name of owning interface (may be NULL), size of queue (in senblk
+ *  structures), whether the queue has multiple producers, overflow policy,
+ *  time to wait for space for Q_BLOCK (0 for default) and whether to split
+ *  the queue into priority lanes
+ *  Returns: Pointer to new queue, NULL on failure
+ */
+static ioqueue_t *q_new(const char *name, size_t size, int mp,
+        enum qpolicy policy, int blockms, int lanes)
+{
+    ioqueue_t *newq;
+    size_t cells;
+    int i;
+
+    /* Round the number of cells up to a power of 2 so that positions can be
+     * masked rather than divided.  No more than "size" sentences are ever
+     * queued */
+    for (cells=1;cells && cells<size;cells<<=1);
+    if (size == 0 || cells == 0) {
+        errno=EINVAL;
+        return(NULL);
+    }
+
+    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
+        return(NULL);
+    memset((void *)newq,0,sizeof(ioqueue_t));
+
+    newq->policy=policy;
+    newq->blockms=(blockms)?blockms:DEFQBLOCK;
+    newq->maxcells=cells;
+    newq->mincells=(mp || cells < QMINCELLS)?cells:QMINCELLS;
+    newq->elastic=(newq->mincells < newq->maxcells);
+    newq->size=size;
+    newq->mp=mp;
+    atomic_init(&newq->tail,0);
+    atomic_init(&newq->head,0);
+    atomic_init(&newq->drops,0);
+    atomic_init(&newq->ccount,0);
+    atomic_init(&newq->stalled,0);
+    if (name)
+        (void) snprintf(newq->name,QNAMESZ,"%s",name);
+
+    pthread_mutex_init(&newq->q_mutex,NULL);
+    ec_init(&newq->ready);
+    ec_init(&newq->room);
+
+    if (policy == Q_CONFLATE) {
+        if ((newq->cslots=(struct cslot *)malloc(size*sizeof(struct cslot)))
+                == NULL)
+            goto fail;
+    } else if (lanes) {
+        for (i=0;i<NPRIO;i++)
+            if ((newq->lane[i]=q_new(name,size,0,Q_OLDEST,0,0)) == NULL)
+                goto fail;
+    } else {
+        if ((newq->ring=ring_alloc(newq->mincells,0)) == NULL)
+            goto fail;
+        newq->prod=newq->cons=newq->ring;
+    }
+
+    atomic_store(&newq->active,1);
+    return(newq);
+
+fail:
+    q_free(newq);
+    errno=ENOMEM;
+    return(NULL);
+}
+
+/*
+ *  Initialise an ioqueue for an output
+ *  Args: iface_t to add queue to, size of queue (in senblk structures)
+ *  Returns: 0 on success, -1 on failure
+ *  The overflow policy is taken from the interface.  Queues dropping the
+ *  oldest sentence have priority lanes if any priorities have been set
+ */
+int init_q(iface_t *ifa, size_t size)
+{
+    if ((ifa->q=q_new(ifa->name,size,0,ifa->qpolicy,ifa->qblock,
+            (npriotab && ifa->qpolicy == Q_OLDEST))) == NULL)
+        return(-1);
+    return(0);
+}
+
+/*
+ *  Initialise the engine's ioqueue, which all inputs write to
+ *  Args: iface_t to add queue to, size of queue (in senblk structures)
+ *  Returns: 0 on success, -1 on failure
+ *  Multiple producer queues always drop the oldest sentence and are never
+ *  resized
+ */
+int init_engine_q(iface_t *ifa, size_t size)
+{
+    if ((ifa->q=q_new(ifa->name,size,1,Q_OLDEST,0,0)) == NULL)
+        return(-1);
+    return(0);
+}
+
+/*
+ *  Initialise an input's queue to the engine for fair dispatch mode
+ *  Args: iface_t to add queue to, engine's queue
+ *  Returns: 0 on success, -1 on failure
+ *  The queue is the same size as the engine's and drops the oldest sentence
+ *  when full.  Adding to it wakes the engine
+ */
+int init_ingress_q(iface_t *ifa, ioqueue_t *eq)
+{
+    if ((ifa->q=q_new(ifa->name,eq->size,0,Q_OLDEST,0,0)) == NULL)
+        return(-1);
+    ifa->q->notify=eq;
+    ifa->q->weight=(ifa->weight)?ifa->weight:1;
+    return(0);
+}
+
+/*
+ * Free the memory associated with an (empty) ioqueue
+ * Args: queue to be freed
+ * Returns: Nothing
+ */
+static void q_free(ioqueue_t *q)
+{
+    struct qring *r;
+    int i;
+
+    while ((r=q->ring) != NULL) {
+        q->ring=atomic_load_explicit(&r->next,memory_order_relaxed);
+        free(r);
+    }
+    for (i=0;i<NPRIO;i++)
+        if (q->lane[i])
+            q_free(q->lane[i]);
+    free(q->cslots);
+    pthread_mutex_destroy(&q->q_mutex);
+    ec_destroy(&q->ready);
+    ec_destroy(&q->room);
+    free(q);
+}
+
+/*
+ * Free an ioqueue and the memory associated with it
+ * Args: queue to be freed
+ * Returns: Nothing
+ */
+void free_q(ioqueue_t *q)
+{
+    int i,drops;
+
+    if (q == NULL)
+        return;
+
+    flush_queue(q);
+    if (!q->mp) {
+        drops=atomic_load(&q->drops);
+        for (i=0;i<NPRIO;i++)
+            if (q->lane[i])
+                drops+=atomic_load(&q->lane[i]->drops);
+        DEBUG(3,"%s: peak queue depth %lu of %lu, %d dropped",
+                (*q->name)?q->name:"(unknown)",(unsigned long) q->peak,
+                (unsigned long) q->size,drops);
+    }
+    q_free(q);
+}
+
+/*
+ *  Copy information in a senblk structure (sentence, its index and source)
+ *  Args: pointers to dest and source senblk structures
+ *  Returns: pointer to dest senblk
+ */
+senblk_t *senblk_copy(senblk_t *dptr,senblk_t *sptr)
+{
+    dptr->len=sptr->len;
+    dptr->src=sptr->src;
+    dptr->prio=sptr->prio;
+    dptr->type=sptr->type;
+    dptr->nfields=sptr->nfields;
+    memcpy(dptr->sep,sptr->sep,sizeof(dptr->sep));
+    dptr->next=NULL;
+    return (senblk_t *) memcpy((void *)dptr->data,(const void *)sptr->data,
+            sptr->len);
+}
+
+/*
+ * Find the cell holding a position on a ring, moving on to later segments
+ * if finished with the current one
+ * Args: Pointer to queue, position
+ * Returns: Pointer to cell.  q->cons is left pointing to the segment it is in
+ * Only the consumer calls this
+ */
+static struct qcell *cons_cell(ioqueue_t *q, size_t h)
+{
+    struct qring *r,*n;
+
+    /* end is only valid once next has been set */
+    for (r=q->cons;(n=atomic_load_explicit(&r->next,memory_order_acquire))
+            != NULL && (ssize_t)(h-r->end) >= 0;r=n)
+        atomic_store_explicit(&r->done,1,memory_order_release);
+    q->cons=r;
+    return(&r->cell[h & r->mask]);
+}
+
+/*
+ * Find the cell holding a position on a ring
+ * Args: Pointer to queue, position
+ * Returns: Pointer to cell, mask of the segment it is in
+ * Only the (single) producer calls this for elastic rings.  Positions are
+ * never earlier than the oldest segment not freed
+ */
+static struct qcell *prod_cell(ioqueue_t *q, size_t h, size_t *mask)
+{
+    struct qring *r,*n;
+
+    for (r=q->ring;(n=atomic_load_explicit(&r->next,memory_order_relaxed))
+            != NULL && (ssize_t)(h-r->end) >= 0;r=n);
+    *mask=r->mask;
+    return(&r->cell[h & r->mask]);
+}
+
+/*
+ * Test whether a ring (or all of a queue's lanes) is empty
+ * Args: Pointer to queue
+ * Returns: 1 if there is nothing ready at the head of the ring, 0 otherwise
+ */
+static int ring_empty(ioqueue_t *q)
+{
+    size_t h,seq;
+    int i;
+
+    if (q->lane[0]) {
+        for (i=0;i<NPRIO;i++)
+            if (!ring_empty(q->lane[i]))
+                return(0);
+        return(1);
+    }
+
+    h=atomic_load_explicit(&q->head,memory_order_acquire);
+    seq=atomic_load_explicit(&cons_cell(q,h)->seq,memory_order_acquire);
+    return((ssize_t)(seq-(h+1)) < 0);
+}
+
+/*
+ * Unlock a queue's mutex.  Cleanup handler for threads holding it:
+ * interface threads are shut down with pthread_exit() from a signal handler
+ * Args: Pointer to queue (cast to void *)
+ * Returns: Nothing
+ */
+static void q_unlock(void *arg)
+{
+    pthread_mutex_unlock(&((ioqueue_t *) arg)->q_mutex);
+}
+
+/*
+ * Wait for the consumer to make space on a full ring
+ * Args: Pointer to queue
+ * Returns: 0 if there is now space, -1 if the queue's block timeout expired
+ * or the queue has been shut down
+ * Only the (single) producer of a Q_BLOCK queue calls this
+ */
+static int ring_wait_room(ioqueue_t *q)
+{
+    struct timespec start,now;
+    size_t t;
+    unsigned key;
+    long left;
+
+    (void) clock_gettime(CLOCK_MONOTONIC,&start);
+    t=atomic_load_explicit(&q->tail,memory_order_relaxed);
+    for (;;) {
+        key=ec_prepare(&q->room);
+        if (t-atomic_load_explicit(&q->head,memory_order_acquire) < q->size) {
+            ec_cancel(&q->room);
+            return(0);
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC,&now);
+        left=q->blockms-((now.tv_sec-start.tv_sec)*1000+
+                (now.tv_nsec-start.tv_nsec)/1000000);
+        if (!atomic_load(&q->active) || left <= 0) {
+            ec_cancel(&q->room);
+            return(-1);
+        }
+        ec_wait(&q->room,key,left);
+    }
+}
+
+/*
+ * Take the sentence at the head of a ring
+ * Args: Pointer to queue
+ * Returns: The senblk removed from the ring (whose reference passes to the
+ * caller) or NULL if the ring was empty
+ * Only the consumer calls this
+ */
+static senblk_t *ring_take(ioqueue_t *q)
+{
+    size_t h,seq;
+    struct qcell *cell;
+    senblk_t *sptr;
+
+    h=atomic_load_explicit(&q->head,memory_order_relaxed);
+    for (;;) {
+        cell=cons_cell(q,h);
+        seq=atomic_load_explicit(&cell->seq,memory_order_acquire);
+        if (seq == h+1) {
+            if (atomic_compare_exchange_weak_explicit(&q->head,&h,h+1,
+                    memory_order_acq_rel,memory_order_relaxed))
+                break;
+            /* Lost a race with a producer dropping the oldest entry: h
+             * has been updated with the new head */
+            continue;
+        }
+        if ((ssize_t)(seq-(h+1)) < 0)
+            /* Nothing (completely) written here yet */
+            return(NULL);
+        /* A producer has dropped entries from under us. Try the new head */
+        h=atomic_load_explicit(&q->head,memory_order_acquire);
+    }
+
+    sptr=cell->sblk;
+    atomic_store_explicit(&cell->seq,h+q->cons->mask+1,memory_order_release);
+    if (q->policy == Q_BLOCK)
+        ec_notify(&q->room);
+    return(sptr);
+}
+
+/*
+ * Note a sentence being dropped from a queue
+ * Args: Pointer to queue, description of what was dropped
+ * Returns: Nothing
+ */
+static void q_drop(ioqueue_t *q, const char *what)
+{
+    atomic_fetch_add_explicit(&q->drops,1,memory_order_relaxed);
+    DEBUG(4,"Dropped %ssenblk q=%s",what,(*q->name)?q->name:"(unknown)");
+}
+
+/*
+ * Drop the sentence at the head of a ring just as the consumer would take it
+ * Args: Pointer to queue, position of head
+ * Returns: 0 if the head is still being written, 1 otherwise.  If someone
+ * else beats us to the head there's space anyway
+ */
+static int ring_evict(ioqueue_t *q, size_t h)
+{
+    struct qcell *cell;
+    senblk_t *sptr;
+    size_t seq,mask;
+
+    cell=prod_cell(q,h,&mask);
+    seq=atomic_load_explicit(&cell->seq,memory_order_acquire);
+    if (seq != h+1)
+        return((ssize_t)(seq-(h+1)) > 0);
+
+    if (atomic_compare_exchange_strong_explicit(&q->head,&h,h+1,
+            memory_order_acq_rel,memory_order_relaxed)) {
+        sptr=cell->sblk;
+        atomic_store_explicit(&cell->seq,h+mask+1,memory_order_release);
+        senblk_release(sptr);
+        q_drop(q,"");
+    }
+    return(1);
+}
+
+/*
+ * Start writing to a new ring segment of a different size
+ * Args: Pointer to queue, first position to be written to the new segment,
+ * number of cells in it
+ * Returns: Nothing.  If a new segment can't be allocated we carry on with
+ * the current one
+ */
+static void ring_resize(ioqueue_t *q, size_t t, size_t cells)
+{
+    struct qring *r;
+
+    if ((r=ring_alloc(cells,t)) == NULL)
+        return;
+
+    DEBUG(5,"%s: queue resized from %lu to %lu",(*q->name)?q->name:
+            "(unknown)",(unsigned long) q->prod->mask+1,(unsigned long) cells);
+    q->prod->end=t;
+    atomic_store_explicit(&q->prod->next,r,memory_order_release);
+    q->prod=r;
+    q->lowcount=0;
+}
+
+/*
+ * Record the depth of a single producer ring before adding a sentence to it,
+ * and grow or shrink it if it's elastic
+ * Args: Pointer to queue, position about to be written
+ * Returns: Nothing
+ */
+static void ring_watermark(ioqueue_t *q, size_t t)
+{
+    struct qring *r;
+    size_t depth,cells;
+
+    depth=t-atomic_load_explicit(&q->head,memory_order_acquire);
+    if (depth >= q->peak)
+        q->peak=depth+1;
+
+    if (!q->elastic)
+        return;
+
+    /* Free segments the consumer has finished with */
+    while ((r=q->ring) != q->prod &&
+            atomic_load_explicit(&r->done,memory_order_acquire)) {
+        q->ring=atomic_load_explicit(&r->next,memory_order_relaxed);
+        free(r);
+    }
+
+    cells=q->prod->mask+1;
+    if (depth >= cells-cells/4) {
+        if (cells < q->maxcells)
+            ring_resize(q,t,cells<<1);
+    } else if (depth <= cells/8 && cells > q->mincells && q->ring == q->prod) {
+        if (++q->lowcount >= QSHRINKAFTER && q->lowcount >= cells)
+            ring_resize(q,t,cells>>1);
+    } else
+        q->lowcount=0;
+}
+
+/*
+ * Reserve the next position at the tail of a ring.  If the ring is full,
+ * drop the oldest sentence on it or fail, according to the queue's policy
+ * Args: Pointer to queue, pointer to position to be filled in
+ * Returns: Pointer to the cell reserved, NULL if none could be reserved
+ */
+static struct qcell *ring_reserve(ioqueue_t *q, size_t *pos)
+{
+    size_t h,t,seq;
+    struct qcell *cell;
+    int spins=0;
+
+    t=atomic_load_explicit(&q->tail,memory_order_relaxed);
+    if (!q->mp)
+        ring_watermark(q,t);
+    for (;;) {
+        h=atomic_load_explicit(&q->head,memory_order_acquire);
+        if ((ssize_t)(t-h) < 0) {
+            /* head has moved past our stale view of the tail */
+            t=atomic_load_explicit(&q->tail,memory_order_relaxed);
+            continue;
+        }
+
+        if (t-h >= q->size) {
+            if (q->policy == Q_NEWEST)
+                break;
+            if (q->policy == Q_BLOCK &&
+                    !atomic_load_explicit(&q->stalled,memory_order_relaxed)) {
+                if (ring_wait_room(q) == 0)
+                    continue;
+                if (!atomic_load(&q->active))
+                    break;
+                /* One wait is all a slow output gets to hold up the others.
+                 * Drop the oldest instead until the writer has caught up.
+                 * See next_senblk() */
+                DEBUG(3,"Output queue %s stalled: dropping oldest",q->name);
+                atomic_store_explicit(&q->stalled,1,memory_order_relaxed);
+            }
+            /* Ring full: drop the oldest sentence.  If the oldest is still
+             * being written, wait for it */
+            if (!ring_evict(q,h) && ++spins == QSPINS)
+                break;
+            if (q->mp)
+                t=atomic_load_explicit(&q->tail,memory_order_relaxed);
+            continue;
+        }
+
+        cell=&q->prod->cell[t & q->prod->mask];
+        seq=atomic_load_explicit(&cell->seq,memory_order_acquire);
+        if (seq == t) {
+            if (!q->mp) {
+                atomic_store_explicit(&q->tail,t+1,memory_order_relaxed);
+                *pos=t;
+                return(cell);
+            }
+            if (atomic_compare_exchange_weak_explicit(&q->tail,&t,t+1,
+                    memory_order_relaxed,memory_order_relaxed)) {
+                *pos=t;
+                return(cell);
+            }
+            /* t has been updated with the current tail */
+        } else if ((ssize_t)(seq-t) < 0) {
+            /* Consumer is still taking from this cell */
+            if (++spins == QSPINS)
+                break;
+        } else
+            /* Another producer got here first */
+            t=atomic_load_explicit(&q->tail,memory_order_relaxed);
+    }
+
+    q_drop(q,"new ");
+    return(NULL);
+}
+
+/*
+ * Add a reference to a senblk to a conflating queue, replacing any queued
+ * sentence of the same type
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ * The caller's reference to the senblk is handed to the queue
+ */
+static void conflate_push(senblk_t *sptr, ioqueue_t *q)
+{
+    struct cslot *slot;
+    senblk_t *old=NULL;
+    size_t i;
+    int keyed;
+
+    /* Only "$" sentences with a 5 character address field are conflated.
+     * Anything else gets a slot of its own */
+    keyed=(sptr->data[0] == '$' && sptr->len > 6 &&
+            (sptr->data[6] == ',' || sptr->data[6] == '*'));
+
+    pthread_mutex_lock(&q->q_mutex);
+    if (keyed)
+        for (i=0;i<q->ccount;i++) {
+            slot=&q->cslots[(q->chead+i)%q->size];
+            if (slot->type == sptr->type) {
+                old=slot->sblk;
+                slot->sblk=sptr;
+                break;
+            }
+        }
+
+    if (old == NULL) {
+        if (q->ccount == q->size) {
+            old=q->cslots[q->chead].sblk;
+            q->chead=(q->chead+1)%q->size;
+            q->ccount--;
+            q_drop(q,"");
+        }
+        slot=&q->cslots[(q->chead+q->ccount++)%q->size];
+        slot->type=(keyed)?sptr->type:0;
+        slot->sblk=sptr;
+    }
+    pthread_mutex_unlock(&q->q_mutex);
+
+    if (old)
+        senblk_release(old);
+    else
+        ec_notify(&q->ready);
+}
+
+/*
+ * Take sentences from the head of a conflating queue
+ * Args: Pointer to queue, array to be filled in with senblk pointers,
+ * maximum number of senblks to take
+ * Returns: Number of senblks taken (0 if the queue is empty)
+ */
+static int conflate_take(ioqueue_t *q, senblk_t **sv, int max)
+{
+    int n=0;
+
+    if (atomic_load_explicit(&q->ccount,memory_order_relaxed) == 0)
+        return(0);
+
+    pthread_mutex_lock(&q->q_mutex);
+    pthread_cleanup_push(q_unlock,q);
+    for (;n < max && q->ccount;n++) {
+        sv[n]=q->cslots[q->chead].sblk;
+        q->chead=(q->chead+1)%q->size;
+        q->ccount--;
+    }
+    pthread_cleanup_pop(1);
+    return(n);
+}
+
+/*
+ * Take the sentence at the head of a queue without waiting
+ * Args: Pointer to queue
+ * Returns: The senblk removed from the queue or NULL if it was empty
+ */
+static senblk_t *q_take(ioqueue_t *q)
+{
+    senblk_t *sptr;
+    int i;
+
+    if (q->policy == Q_CONFLATE)
+        return((conflate_take(q,&sptr,1))?sptr:NULL);
+
+    if (q->lane[0] == NULL)
+        return(ring_take(q));
+
+    for (i=0;i<NPRIO;i++)
+        if ((sptr=ring_take(q->lane[i])) != NULL)
+            return(sptr);
+    return(NULL);
+}
+
+/*
+ * Check whether there is anything to take from a queue
+ * Args: Pointer to queue
+ * Returns: 1 if the queue is empty, 0 otherwise
+ */
+static int q_empty(ioqueue_t *q)
+{
+    if (q->policy == Q_CONFLATE)
+        return(atomic_load_explicit(&q->ccount,memory_order_acquire) == 0);
+    return(ring_empty(q));
+}
+
+/*
+ * Wait until there is something on a queue or it is shut down
+ * Args: Pointer to queue
+ * Returns: 0 if data may be available, -1 if the queue is empty and inactive
+ * Only the consumer calls this.  It polls for a short while before going to
+ * sleep so that a producer which is about to add something needn't wake it
+ */
+static int q_wait(ioqueue_t *q)
+{
+    unsigned key;
+    int i;
+
+    for (i=0;i<QPARKSPINS;i++) {
+        if (!q_empty(q))
+            return(0);
+        cpu_relax();
+    }
+
+    for (;;) {
+        key=ec_prepare(&q->ready);
+        if (!q_empty(q)) {
+            ec_cancel(&q->ready);
+            return(0);
+        }
+        if (!atomic_load(&q->active)) {
+            ec_cancel(&q->ready);
+            return(-1);
+        }
+        ec_wait(&q->ready,key,-1);
+    }
+}
+
+/*
+ * Make space for a new sentence on a queue with priority lanes if it's full
+ * Args: Pointer to queue, priority of new sentence
+ * Returns: 0 if there is space for the new sentence, -1 if it should be
+ * dropped
+ * Only the (single) producer calls this
+ */
+static int lanes_room(ioqueue_t *q, int prio)
+{
+    size_t depth,head[NPRIO],ldepth[NPRIO];
+    int i,spins=0;
+
+    for (;;) {
+        for (depth=0,i=0;i<NPRIO;i++) {
+            head[i]=atomic_load_explicit(&q->lane[i]->head,
+                    memory_order_acquire);
+            ldepth[i]=atomic_load_explicit(&q->lane[i]->tail,
+                    memory_order_relaxed)-head[i];
+            depth+=ldepth[i];
+        }
+        if (depth < q->size)
+            break;
+
+        /* Evict from the lowest priority lane with anything in it, as long
+         * as that's no higher priority than the new sentence */
+        for (i=NPRIO-1;i > prio && ldepth[i] == 0;i--);
+        if (ldepth[i] == 0)
+            return(-1);
+        if (!ring_evict(q->lane[i],head[i]) && ++spins == QSPINS)
+            return(-1);
+    }
+
+    if (depth >= q->peak)
+        q->peak=depth+1;
+    return(0);
+}
+
+/*
+ * Allocate a pool senblk for an input to frame a sentence in before adding
+ * it to a queue with commit_senblk()
+ * Args: Pointer to queue the sentence is for
+ * Returns: Pointer to senblk, NULL if none could be allocated, in which
+ * case the sentence counts as dropped from the queue
+ * An input which decides not to queue the sentence can re-use the senblk
+ * for the next one, or give it up with senblk_release()
+ */
+senblk_t *reserve_senblk(ioqueue_t *q)
+{
+    senblk_t *sptr;
+
+    if ((sptr=senblk_alloc(0)) == NULL)
+        q_drop(q,"new ");
+    return(sptr);
+}
+
+/*
+ * Move a sentence being framed to a larger senblk
+ * Args: Pointer to the caller's senblk pointer, number of bytes of data
+ * used so far, number of bytes the senblk must be able to hold and pointer
+ * to the queue the sentence is for
+ * Returns: 0 on success with *spp pointing at the new senblk, -1 if
+ * no larger senblk could be allocated, in which case the sentence counts as
+ * dropped from the queue and *spp is unchanged
+ * The old senblk is released.  Everything an input sets before framing is
+ * complete is carried over
+ */
+int grow_senblk(senblk_t **spp, size_t used, size_t len, ioqueue_t *q)
+{
+    senblk_t *optr=*spp,*nptr;
+
+    if ((nptr=senblk_alloc(len)) == NULL) {
+        q_drop(q,"long ");
+        return(-1);
+    }
+    nptr->src=optr->src;
+    nptr->prio=optr->prio;
+    nptr->nfields=optr->nfields;
+    memcpy(nptr->sep,optr->sep,sizeof(nptr->sep));
+    memcpy(nptr->data,optr->data,used);
+    senblk_release(optr);
+    *spp=nptr;
+    return(0);
+}
+
+/*
+ * Add a pool senblk to an ioqueue, handing over the caller's reference
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ * The caller must not use the senblk afterwards.  If it is dropped, the
+ * reference is released
+ */
+void commit_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    struct qcell *cell;
+    ioqueue_t *lq=q;
+    size_t t;
+
+    if (q->policy == Q_CONFLATE) {
+        conflate_push(sptr,q);
+        return;
+    }
+
+    if (q->lane[0]) {
+        if (lanes_room(q,sptr->prio) < 0) {
+            q_drop(q,"new ");
+            senblk_release(sptr);
+            return;
+        }
+        lq=q->lane[sptr->prio];
+    }
+
+    if ((cell=ring_reserve(lq,&t)) == NULL) {
+        senblk_release(sptr);
+        return;
+    }
+
+    cell->sblk=sptr;
+    atomic_store_explicit(&cell->seq,t+1,memory_order_release);
+    ec_notify((q->notify)?&q->notify->ready:&q->ready);
+}
+
+/*
+ * Add a reference to a pool senblk to an ioqueue
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ * Side effects: senblk's reference count is incremented if it is queued
+ */
+void push_senblk_ref(senblk_t *sptr, ioqueue_t *q)
+{
+    atomic_fetch_add_explicit(&sptr->refs,1,memory_order_relaxed);
+    commit_senblk(sptr,q);
+}
+
+/*
+ * Add a copy of an senblk to an ioqueue
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ */
+void push_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    senblk_t *nptr;
+
+    if (sptr == NULL) {
+        /* NULL senblk pointer is magic "off" switch for a queue */
+        atomic_store(&q->active,0);
+        ec_wake(&q->ready);
+        ec_wake(&q->room);
+        return;
+    }
+
+    if ((nptr=senblk_alloc(sptr->len)) == NULL) {
+        q_drop(q,"new ");
+        return;
+    }
+
+    (void) senblk_copy(nptr,sptr);
+    commit_senblk(nptr,q);
+}
+
+/*
+ *  Get the next senblk from the head of a queue
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to next senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ *  The senblk must be returned with senblk_free() when finished with
+ */
+senblk_t *next_senblk(ioqueue_t *q)
+{
+    senblk_t *sptr;
+
+    while ((sptr=q_take(q)) == NULL) {
+        /* The writer has caught up, so a stalled queue may block again */
+        if (atomic_load_explicit(&q->stalled,memory_order_relaxed))
+            atomic_store_explicit(&q->stalled,0,memory_order_relaxed);
+        if (q_wait(q) < 0)
+            break;
+    }
+    return(sptr);
+}
+
+/*
+ *  Get the next senblk from the head of a queue if there is one
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to next senblk on the queue or NULL if it is empty
+ *  The senblk must be returned with senblk_free() when finished with
+ */
+senblk_t *take_senblk(ioqueue_t *q)
+{
+    return(q_take(q));
+}
+
+/*
+ * Wait until there is something on one of the engine's queues in fair
+ * dispatch mode
+ * Args: Engine's queue, array of queues it services (which may include the
+ * engine's own), number of them, flag to be woken by
+ * Returns: 0 if data may be available or the flag is set, -1 if the
+ * engine's queue is inactive and there is nothing to take
+ * Only the engine calls this.  Producers wake it through the engine queue.
+ * Anyone setting the flag must call wake_q() on the engine's queue after
+ */
+int ingress_wait(ioqueue_t *eq, ioqueue_t **in, int n, atomic_int *flag)
+{
+    unsigned key;
+    int i,spins=0;
+
+    for (;;) {
+        if (spins == QPARKSPINS)
+            key=ec_prepare(&eq->ready);
+        for (i=0;i<n && ring_empty(in[i]);i++);
+        if (i < n || atomic_load(flag))
+            break;
+        if (spins < QPARKSPINS) {
+            spins++;
+            cpu_relax();
+            continue;
+        }
+        if (!atomic_load(&eq->active)) {
+            ec_cancel(&eq->ready);
+            return(-1);
+        }
+        ec_wait(&eq->ready,key,-1);
+    }
+    if (spins == QPARKSPINS)
+        ec_cancel(&eq->ready);
+    return(0);
+}
+
+/*
+ * Wake anything waiting for data on a queue, e.g. so it can notice some
+ * other change
+ * Args: Pointer to queue
+ * Returns: Nothing
+ */
+void wake_q(ioqueue_t *q)
+{
+    ec_wake(&q->ready);
+}
+
+/*
+ *  Get all senblks waiting on a queue, up to a maximum
+ *  Args: Queue to retrieve from, array to be filled in with senblk pointers,
+ *  maximum number of senblks to retrieve
+ *  Returns: Number of senblks retrieved or 0 if the queue is no longer active
+ *  This function blocks until data are available or the queue is shut down
+ *  Each senblk must be returned with senblk_free() when finished with
+ */
+int next_senblk_batch(ioqueue_t *q, senblk_t **sv, int max)
+{
+    int n;
+
+    if (q->policy == Q_CONFLATE) {
+        while ((n=conflate_take(q,sv,max)) == 0)
+            if (q_wait(q) < 0)
+                break;
+        return(n);
+    }
+
+    if ((sv[0]=next_senblk(q)) == NULL)
+        return(0);
+
+    for (n=1;n < max && (sv[n]=q_take(q)) != NULL;n++);
+    return(n);
+}
+
+/*
+ *  Get the last senblk from a queue, discarding all before it
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to last senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ *  The senblk must be returned with senblk_free() when finished with
+ */
+senblk_t *last_senblk(ioqueue_t *q)
+{
+    senblk_t *sptr,*tptr;
+
+    if ((sptr=q_take(q)) == NULL)
+        return(next_senblk(q));
+
+    while ((tptr=q_take(q)) != NULL) {
+        senblk_release(sptr);
+        sptr=tptr;
+    }
+    return(sptr);
+}
+
+/*
+ * Flush a queue, discarding anything on it
+ * Args: Queue to be flushed
+ * Returns: Nothing
+ */
+void flush_queue(ioqueue_t *q)
+{
+    senblk_t *sptr;
+
+    while ((sptr=q_take(q)) != NULL)
+        senblk_release(sptr);
+}
+
+/*
+ * Release a senblk returned by next_senblk() or last_senblk()
+ * Args: pointer to senblk, and pointer to the queue it came from
+ * Returns: Nothing
+ */
+void senblk_free(senblk_t *sptr, ioqueue_t *q)
+{
+    senblk_release(sptr);
+}
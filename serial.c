@@ -212,65 +212,41 @@ ssize_t read_serial(struct iface *ifa, char *buf)
 void write_serial(struct iface *ifa)
 {
     struct if_serial *ifs = (struct if_serial *) ifa->info;
-    senblk_t *senblk_p;
+    senblk_t *sv[WBATCH];
+    struct iovec tv[WBATCH];
+    struct iovec iov[2*WBATCH];
     int fd=ifs->fd;
-    int n=0,tlen=0;
-    char *ptr;
-    char *tbuf;
+    int i,n,cnt,err=0;
+    char *tbuf=NULL;
 
     if (ifa->tagflags) {
-        if ((tbuf=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*WBATCH)) == NULL) {
             logerr(errno,"Disabing tag output on interface id %u (%s)",
                 ifa->id,(ifa->name)?ifa->name:"unlabelled");
             ifa->tagflags=0;
         }
     }
 
-    while(n >= 0) {
-        /* NULL return from next_senblk means the queue has been shut
+    while(!err) {
+        /* 0 return from next_batch means the queue has been shut
          * down. Time to die */
-        if ((senblk_p = next_senblk(ifa->q)) == NULL)
+        if ((n = next_batch(ifa,sv,tv,&tbuf)) == 0)
             break;
 
-        if (senfilter(senblk_p,ifa->ofilter)) {
-            senblk_free(senblk_p,ifa->q);
-            continue;
+        for (i=cnt=0;i<n;i++) {
+            if (tv[i].iov_len)
+                iov[cnt++]=tv[i];
+            iov[cnt].iov_base=sv[i]->data;
+            iov[cnt++].iov_len=sv[i]->len;
         }
 
-        if (ifa->tagflags) {
-            if ((tlen = gettag(ifa,tbuf,senblk_p)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                    ifa->id,(ifa->name)?ifa->name:"unlabelled");
-                ifa->tagflags=0;
-                free(tbuf);
-            }
-            ptr=tbuf;
-            while(tlen) {
-                if ((n=write(fd,ptr,tlen)) < 0)
-                    break;
-                tlen-=n;
-                ptr+=n;
-            }
-            if (tlen) {
-                senblk_free(senblk_p,ifa->q);
-                break;
-            }
-        }
+        err=writev_all(fd,iov,cnt);
 
-        ptr=senblk_p->data;
-        tlen=senblk_p->len;
-        while(tlen) {
-            if ((n=write(fd,ptr,tlen)) < 0)
-                break;
-            tlen-=n;
-            ptr+=n;
-        }
-        senblk_free(senblk_p,ifa->q);
-        if (tlen)
-            break;
+        for (i=0;i<n;i++)
+            senblk_free(sv[i],ifa->q);
     }
 
-    if (ifa->tagflags)
+    if (tbuf)
         free(tbuf);
 
     iface_thread_exit(errno);
@@ -396,49 +396,37 @@ ssize_t read_tcp(struct iface *ifa, char *buf)
 void write_tcp(struct iface *ifa)
 {
     struct if_tcp *ift = (struct if_tcp *) ifa->info;
-    senblk_t *sptr;
+    senblk_t *sv[WBATCH];
+    struct iovec tv[WBATCH];
+    struct iovec iov[2*WBATCH];
     int status=0;
     int err=0;
-    int data=0;
-    int cnt=1;
+    int i,n,cnt;
     int done = 0;
-    struct iovec iov[2];
+    char *tbuf=NULL;
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*WBATCH)) == NULL) {
                 logerr(errno,"Disabing tag output on interface id %x (%s)",
                         ifa->id,ifa->name);
                 ifa->tagflags=0;
-        } else {
-            cnt=2;
-            data=1;
         }
     }
 
     for(;(!done);) {
 
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n = next_batch(ifa,sv,tv,&tbuf)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
-        }
-
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %x (%s)",
-                        ifa->id,ifa->name);
-                ifa->tagflags=0;
-                cnt=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
         /* SIGPIPE is blocked here so we can avoid using the (non-portable)
          * MSG_NOSIGNAL
          */
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
+        for (i=cnt=0;i<n;i++) {
+            if (tv[i].iov_len)
+                iov[cnt++]=tv[i];
+            iov[cnt].iov_base=sv[i]->data;
+            iov[cnt++].iov_len=sv[i]->len;
+        }
         if (flag_test(ifa,F_PERSIST)) {
             pthread_mutex_lock(&ift->shared->t_mutex);
             if (ift->fd == -1)
@@ -447,15 +435,17 @@ void write_tcp(struct iface *ifa)
                 ift->shared->critical++;
             pthread_mutex_unlock(&ift->shared->t_mutex);
             if (done) {
-                senblk_free(sptr,ifa->q);
+                for (i=0;i<n;i++)
+                    senblk_free(sv[i],ifa->q);
                 break;
             }
         }
-        if (writev(ift->fd,iov,cnt) <0) {
+        if (writev_all(ift->fd,iov,cnt) <0) {
             DEBUG2(3,"%s id %x: write failed",ifa->name,ifa->id);
             err=errno;
             if (!flag_test(ifa,F_PERSIST)) {
-                senblk_free(sptr,ifa->q);
+                for (i=0;i<n;i++)
+                    senblk_free(sv[i],ifa->q);
                 break;
             }
             pthread_mutex_lock(&ift->shared->t_mutex);
@@ -488,11 +478,12 @@ void write_tcp(struct iface *ifa)
                 pthread_cond_signal(&ift->shared->fv);
             pthread_mutex_unlock(&ift->shared->t_mutex);
         }
-        senblk_free(sptr,ifa->q);
+        for (i=0;i<n;i++)
+            senblk_free(sv[i],ifa->q);
     }
 
-    if (cnt == 2)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
@@ -567,31 +558,68 @@ void delayed_connect(iface_t *ifa)
     }
 }
 
+/*
+ * Free a new tcp connection which could not be started, closing its socket
+ * Args: Pointer to connection's interface, with any pair
+ * Returns: Nothing
+ */
+static void discard_tcp_conn(iface_t *newifa)
+{
+    iface_t *pair=newifa->pair;
+
+    if (pair) {
+        /* An input's queue is its own only in fair dispatch mode */
+        if (pair->q && pair->q->notify)
+            free_q(pair->q);
+        free_filter(pair->ifilter);
+        free_filter(pair->ofilter);
+        free(pair->info);
+        free(pair);
+    }
+    free_filter(newifa->ifilter);
+    free_filter(newifa->ofilter);
+    if (newifa->q && (newifa->direction != IN || newifa->q->notify))
+        free_q(newifa->q);
+    close(((struct if_tcp *) newifa->info)->fd);
+    free(newifa->info);
+    free(newifa);
+}
+
+/*
+ * Start an interface for a connection accepted by a tcp server
+ * Args: Accepted socket, pointer to server's interface
+ * Returns: Pointer to new interface, or NULL on failure in which case the
+ * socket has been closed
+ */
 iface_t *new_tcp_conn(int fd, iface_t *ifa)
 {
     iface_t *newifa;
     struct if_tcp *oldift=(struct if_tcp *) ifa->info;
     struct if_tcp *newift=NULL;
     pthread_t tid;
-    int on=1;
+    int on=1,err;
     sigset_t set,saved;
 
     if ((newifa = malloc(sizeof(iface_t))) == NULL) {
         logerr(errno,"malloc failed for %s",ifa->name);
+        close(fd);
         return(NULL);
     }
 
     memset(newifa,0,sizeof(iface_t));
+    newifa->qpolicy=ifa->qpolicy;
+    newifa->qblock=ifa->qblock;
 
     if (((newift = (struct if_tcp *) malloc(sizeof(struct if_tcp))) == NULL) ||
             ((ifa->direction != IN) &&
             (init_q(newifa, oldift->qsize) < 0))) {
         logerr(errno,"Failed to set up new connection");
         if (newifa && newifa->q)
-            free(newifa->q);
+            free_q(newifa->q);
         if (newift)
             free(newift);
         free(newifa);
+        close(fd);
         return(NULL);
     }
     memset(newift,0,sizeof(struct if_tcp));
@@ -614,28 +642,46 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
     newifa->ofilter=addfilter(ifa->ofilter);
     newifa->checksum=ifa->checksum;
     newifa->strict=ifa->strict;
-    if (ifa->direction == IN)
-        newifa->q=ifa->lists->engine->q;
-    else {
+    newifa->senmax=ifa->senmax;
+    newifa->weight=ifa->weight;
+    newifa->sched=ifa->sched;
+    if (ifa->direction == IN) {
+        if (attach_input(newifa) < 0) {
+            logerr(errno,"Failed to set up new connection");
+            discard_tcp_conn(newifa);
+            return(NULL);
+        }
+    } else {
         if (setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on)) < 0)
             logerr(errno,"Could not disable Nagle on new tcp connection");
 
         if (ifa->direction == BOTH) {
             if ((newifa->next=ifdup(newifa)) == NULL) {
                 logwarn("Interface duplication failed");
-                free(newifa->q);
-                free(newift);
-                free(newifa);
+                discard_tcp_conn(newifa);
                 return(NULL);
             }
             newifa->direction=OUT;
             newifa->pair->direction=IN;
-            newifa->pair->q=ifa->lists->engine->q;
+            if (attach_input(newifa->pair) < 0) {
+                logerr(errno,"Failed to set up new connection");
+                discard_tcp_conn(newifa);
+                return(NULL);
+            }
             sigemptyset(&set);
             sigaddset(&set, SIGUSR1);
             pthread_sigmask(SIG_BLOCK, &set, &saved);
             link_to_initialized(newifa->pair);
-            pthread_create(&tid,NULL,(void *)start_interface,(void *) newifa->pair);
+            if ((err=thread_create(&tid,&newifa->pair->sched,
+                    (void *)start_interface,(void *) newifa->pair)) != 0) {
+                logerr(err,"Failed to start new connection");
+                pthread_mutex_lock(&ifa->lists->io_mutex);
+                unlink_initialized(newifa->pair);
+                pthread_mutex_unlock(&ifa->lists->io_mutex);
+                pthread_sigmask(SIG_SETMASK,&saved,NULL);
+                discard_tcp_conn(newifa);
+                return(NULL);
+            }
             pthread_sigmask(SIG_SETMASK,&saved,NULL);
         }
     }
@@ -643,7 +689,24 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
     sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &set, &saved);
     link_to_initialized(newifa);
-    pthread_create(&tid,NULL,(void *)start_interface,(void *) newifa);
+    if ((err=thread_create(&tid,&newifa->sched,(void *)start_interface,
+            (void *) newifa)) != 0) {
+        logerr(err,"Failed to start new connection");
+        pthread_mutex_lock(&ifa->lists->io_mutex);
+        unlink_initialized(newifa);
+        if (newifa->pair) {
+            /* The pair's thread is already running: free_if_data() tells
+             * it to exit */
+            free_if_data(newifa);
+            free(newifa);
+            newifa=NULL;
+        }
+        pthread_mutex_unlock(&ifa->lists->io_mutex);
+        pthread_sigmask(SIG_SETMASK,&saved,NULL);
+        if (newifa)
+            discard_tcp_conn(newifa);
+        return(NULL);
+    }
     pthread_sigmask(SIG_SETMASK,&saved,NULL);
     return(newifa);
 }
@@ -667,12 +730,10 @@ void tcp_server(iface_t *ifa)
                 continue;
             }
     
-            if ((newifa = new_tcp_conn(afd,ifa)) == NULL) {
-                close(afd);
+            if ((newifa = new_tcp_conn(afd,ifa)) == NULL)
                 afd=-1;
-            }
             DEBUG(3,"%s: New connection id %x %ssuccessfully received from %s",
-                    ifa->name,newifa->id,(afd<0)?"un":"",
+                    ifa->name,(newifa)?newifa->id:0,(afd<0)?"un":"",
                     inet_ntop(sad.ss_family,(sad.ss_family == AF_INET)?
                     (const void *) &((struct sockaddr_in *)&sad)->sin_addr:
                     (const void *) &((struct sockaddr_in6 *)&sad)->sin6_addr,
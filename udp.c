@@ -6,6 +6,10 @@
  * UDP interfaces
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* for sendmmsg() and recvmmsg() */
+#endif
+
 #include "kplex.h"
 #include <netdb.h>
 #include <net/if.h>
@@ -13,6 +17,7 @@
 #include <arpa/inet.h>
 
 #define CBUFSIZ 128
+#define RBATCH 16
 
 static struct ignore_addr {
     struct sockaddr_in iaddr;
@@ -28,6 +33,18 @@ struct coalesce {
     char buf[CBUFSIZ];
 };
 
+/* Datagrams received together but not yet passed to do_read() */
+struct rbatch {
+    int n;
+    int next;
+#ifdef MSG_WAITFORONE
+    struct mmsghdr mv[RBATCH];
+    struct iovec iov[RBATCH];
+    struct sockaddr_storage src[RBATCH];
+    char buf[RBATCH][BUFSIZ];
+#endif
+};
+
 struct if_udp {
     int fd;
     enum udptype type;
@@ -39,6 +56,7 @@ struct if_udp {
     } mr;
     struct ignore_addr *ignore;
     struct coalesce *coalesce;
+    struct rbatch *rbatch;
 };
 
 /*
@@ -60,6 +78,7 @@ void *ifdup_udp(void *ifa)
 
     /* In-bound connections don't need pointer to coalesce buffer */
     newif->coalesce = NULL;
+    newif->rbatch = NULL;
 
     /* Whole new file descriptor to bind() to.  Not an issue for Linux but
      * for some other platforms (e.g. OS X) we can't send with a multicast /
@@ -107,73 +126,76 @@ void cleanup_udp(iface_t *ifa)
     if (ifu->coalesce)
         free(ifu->coalesce);
 
+    if (ifu->rbatch)
+        free(ifu->rbatch);
+
     /* iomutex should be locked in the cleanup routine */
     close(ifu->fd);
 }
 
-int is_ais(char *sptr,size_t len,size_t *nfrag, size_t *frag, unsigned int *seq)
+/*
+ * Check whether a sentence is an AIS message and if so which fragment
+ * Args: pointer to senblk, pointers to number of fragments, fragment number
+ * and sequential message id to be filled in
+ * Returns: 1 if the sentence is AIS, 0 otherwise
+ */
+int is_ais(senblk_t *sptr, size_t *nfrag, size_t *frag, unsigned int *seq)
 {
+    size_t v[3],len;
+    char *cptr;
     int i;
 
-    if (len < 13)
-        return(0);
-
-    if (!(sptr[3] == 'V' && sptr[4] == 'D' &&
-            (sptr[5] == 'M' || sptr[5] == 'O')))
+    if (sptr->len < 13)
         return(0);
-    sptr+=6;
 
-    if ((*sptr++) != ',')
+    if (!(sptr->data[3] == 'V' && sptr->data[4] == 'D' &&
+            (sptr->data[5] == 'M' || sptr->data[5] == 'O')))
         return(0);
 
-    for (i=7,*nfrag=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
-        *nfrag = *nfrag*10+*sptr-'0';
-
-    if (*sptr++ != ',' || i > len)
+    /* Fields 1 to 3 must be numeric and followed by at least one more */
+    if (sptr->sep[0] != 6 || sptr->nfields < 5)
         return(0);
 
-    for (*frag=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
-        *frag = *frag*10+*sptr-'0';
-
-    if (*sptr++ != ',' || i > len)
-        return(0);
-
-    for (*seq=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
-        *seq = *seq*10+*sptr-'0';
-
-    if (*sptr != ',' || i > len)
-        return(0);
+    for (i=0;i<3;i++)
+        for (v[i]=0,cptr=senfield(sptr,i+1,&len);len;len--,cptr++) {
+            if (*cptr < '0' || *cptr > '9')
+                return(0);
+            v[i]=v[i]*10+*cptr-'0';
+        }
 
+    *nfrag=v[0];
+    *frag=v[1];
+    *seq=v[2];
     return(1);
 }
 
-int coalesce(struct if_udp *ifu, struct msghdr * mh)
+int coalesce(struct if_udp *ifu, struct msghdr * mh, size_t nfrags,
+        size_t frag, unsigned int seqid)
 {
-    size_t nfrags,frag;
-    unsigned int seqid;
     struct iovec *ioptr = mh->msg_iov;
     int data = mh->msg_iovlen-1;
     size_t len;
     int i;
     struct coalesce *cp = ifu->coalesce;
 
-    if (!(is_ais(ioptr[data].iov_base,ioptr[data].iov_len,
-            &nfrags,&frag,&seqid)))
-        return(0);
-
     if (nfrags == 1 && cp->offset == 0)
         return(0);
 
-    for (i=0;i<mh->msg_iovlen;i++)
-        len=ioptr[i].iov_len;
+    for (len=0,i=0;i<mh->msg_iovlen;i++)
+        len+=ioptr[i].iov_len;
 
-    if ((cp->offset + len) > CBUFSIZ || ((cp->offset) && (cp->seqid != seqid) &&
-            frag < nfrags)) {
+    if (cp->offset && ((cp->offset + len) > CBUFSIZ ||
+            (cp->seqid != seqid && frag < nfrags))) {
         sendto(ifu->fd,cp->buf,cp->offset,0,
                (struct sockaddr *)&ifu->addr,ifu->asize);
         cp->offset=0;
     }
 
+    /* A fragment too big to coalesce (sentences may be up to senmax) is sent
+     * on its own */
+    if (len > CBUFSIZ)
+        return(0);
+
     if (data) {
         memcpy(cp->buf+cp->offset,mh->msg_iov->iov_base,mh->msg_iov->iov_len);
         cp->offset += mh->msg_iov->iov_len;
@@ -193,73 +215,163 @@ int coalesce(struct if_udp *ifu, struct msghdr * mh)
 }
 
 
+/*
+ * Send a batch of datagrams, in a single system call where supported
+ * Args: socket, array of message headers, number of messages (no more than
+ * WBATCH)
+ * Returns: 0 on success, -1 on failure
+ */
+int send_msgs(int fd, struct msghdr *mv, int n)
+{
+    int i;
+#ifdef MSG_WAITFORONE
+    struct mmsghdr mmv[WBATCH];
+    int sent;
+
+    for (i=0;i<n;i++) {
+        mmv[i].msg_hdr=mv[i];
+        mmv[i].msg_len=0;
+    }
+
+    for (i=0;i<n;i+=sent)
+        if ((sent=sendmmsg(fd,mmv+i,n-i,0)) < 0) {
+            if (errno != EINTR)
+                return(-1);
+            sent=0;
+        }
+#else
+    for (i=0;i<n;i++)
+        if (sendmsg(fd,mv+i,0) < 0)
+            return(-1);
+#endif
+    return(0);
+}
+
 void write_udp(struct iface *ifa)
 {
     struct if_udp *ifu;
-    senblk_t *sptr;
-    int data=0;
-    struct msghdr msgh;
-    struct iovec iov[2];
+    senblk_t *sv[WBATCH];
+    struct iovec tv[WBATCH];
+    struct iovec iov[2*WBATCH];
+    struct msghdr msgh,mv[WBATCH];
+    char *tbuf=NULL;
+    int i,n,k,err=0;
+    size_t nfrags,frag;
+    unsigned int seqid;
 
     ifu = (struct if_udp *) ifa->info;
     msgh.msg_name=(void *)&ifu->addr;
     msgh.msg_namelen=ifu->asize;
     msgh.msg_control=NULL;
     msgh.msg_controllen=msgh.msg_flags=0;
-    msgh.msg_iov=iov;
-    msgh.msg_iovlen=1;
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*WBATCH)) == NULL) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
                 ifa->tagflags=0;
-        } else {
-            msgh.msg_iovlen=2;
-            data=1;
         }
     }
-    for (;;) {
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+    while (!err) {
+        if ((n = next_batch(ifa,sv,tv,&tbuf)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
-        }
-
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"%s: Disabing tag output",ifa->name);
-                ifa->tagflags=0;
-                msgh.msg_iovlen=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
-
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-
-        if (ifu->coalesce) {
-            if (coalesce(ifu,&msgh)) {
-                senblk_free(sptr,ifa->q);
-                continue;
+        for (i=k=0;i<n && !err;i++) {
+            mv[k]=msgh;
+            mv[k].msg_iov=iov+2*k;
+            mv[k].msg_iovlen=0;
+            if (tv[i].iov_len)
+                iov[2*k+mv[k].msg_iovlen++]=tv[i];
+            iov[2*k+mv[k].msg_iovlen].iov_base=sv[i]->data;
+            iov[2*k+mv[k].msg_iovlen++].iov_len=sv[i]->len;
+
+            if (ifu->coalesce && is_ais(sv[i],&nfrags,&frag,&seqid)) {
+                /* Keep datagrams in order: coalesce() may send */
+                if (k) {
+                    if ((err=send_msgs(ifu->fd,mv,k)) != 0)
+                        break;
+                    mv[0]=mv[k];
+                    iov[0]=iov[2*k];
+                    iov[1]=iov[2*k+1];
+                    mv[0].msg_iov=iov;
+                    k=0;
+                }
+                if (coalesce(ifu,&mv[0],nfrags,frag,seqid))
+                    continue;
             }
+            k++;
         }
 
-        if (sendmsg(ifu->fd,&msgh,0) < 0)
-            break;
-        senblk_free(sptr,ifa->q);
+        if (k && !err)
+            err=send_msgs(ifu->fd,mv,k);
+
+        for (i=0;i<n;i++)
+            senblk_free(sv[i],ifa->q);
     }
 
-    if (ifa->tagflags)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
 
-ssize_t read_udp(iface_t *ifa, char *buf)
+/*
+ * Receive datagrams for do_read(), a batch at a time in a single system call
+ * where supported.  As many consecutive datagrams as fit in do_read()'s
+ * buffer are returned together.  do_read() carries on framing from one read
+ * to the next, so it sees the same data as it would one datagram at a time
+ * Args: socket, pointer to the interface's batch (allocated on first use),
+ * buffer of BUFSIZ bytes, function to say whether a datagram should be
+ * ignored given its source address and the address's length (NULL if none)
+ * and an argument to pass to that function
+ * Returns: Number of bytes placed in buf, -1 on error
+ */
+ssize_t recv_msgs(int fd, struct rbatch **rbp, char *buf,
+        int (*ign)(void *, struct sockaddr *, socklen_t), void *arg)
 {
-    struct if_udp *ifu = (struct if_udp *) ifa->info;
+#ifdef MSG_WAITFORONE
+    struct rbatch *rb;
+    struct msghdr *mh;
+    size_t len=0;
+    int i;
+
+    if ((rb=*rbp) == NULL) {
+        if ((rb=*rbp=(struct rbatch *) malloc(sizeof(struct rbatch))) == NULL)
+            return(-1);
+        memset(rb->mv,0,sizeof(rb->mv));
+        for (i=0;i<RBATCH;i++) {
+            rb->iov[i].iov_base=rb->buf[i];
+            rb->iov[i].iov_len=BUFSIZ;
+            rb->mv[i].msg_hdr.msg_name=&rb->src[i];
+            rb->mv[i].msg_hdr.msg_iov=&rb->iov[i];
+            rb->mv[i].msg_hdr.msg_iovlen=1;
+        }
+        rb->n=rb->next=0;
+    }
+
+    while (len == 0) {
+        if (rb->next == rb->n) {
+            for (i=0;i<RBATCH;i++)
+                rb->mv[i].msg_hdr.msg_namelen=sizeof(rb->src[i]);
+            rb->next=0;
+            /* Wait for one datagram, then take whatever else is there */
+            if ((rb->n=recvmmsg(fd,rb->mv,RBATCH,MSG_WAITFORONE,NULL)) < 0) {
+                rb->n=0;
+                return(-1);
+            }
+        }
+
+        for (;rb->next < rb->n;rb->next++) {
+            mh=&rb->mv[rb->next].msg_hdr;
+            if (ign && (*ign)(arg,mh->msg_name,mh->msg_namelen))
+                continue;
+            if (rb->mv[rb->next].msg_len > BUFSIZ-len)
+                break;
+            memcpy(buf+len,rb->buf[rb->next],rb->mv[rb->next].msg_len);
+            len+=rb->mv[rb->next].msg_len;
+        }
+    }
+    return(len);
+#else
     struct sockaddr_storage src;
     ssize_t nread;
     struct iovec iov;
@@ -269,7 +381,6 @@ ssize_t read_udp(iface_t *ifa, char *buf)
     iov.iov_len = BUFSIZ;
 
     mh.msg_name = &src;
-    mh.msg_namelen = (socklen_t) sizeof(src);
     mh.msg_iov = &iov;
     mh.msg_iovlen = 1;
     mh.msg_control = NULL;
@@ -277,16 +388,35 @@ ssize_t read_udp(iface_t *ifa, char *buf)
     mh.msg_flags = 0;
 
     do {
-        nread = recvmsg(ifu->fd,&mh,0);
+        mh.msg_namelen = (socklen_t) sizeof(src);
+        if ((nread = recvmsg(fd,&mh,0)) < 0)
+            return(-1);
+    } while (nread == 0 || (ign && (*ign)(arg,mh.msg_name,mh.msg_namelen)));
+    return(nread);
+#endif
+}
 
-        if (ifu->ignore && ifu->ignore->writers) {
-        /* Broadcast Interface: IPv4 */
-            if (memcmp((void *)&src,(void *)&ifu->ignore->iaddr,(size_t) mh.msg_namelen)
-                    == 0) 
-                continue;
-        }
-        return (nread);
-    } while(1);
+/*
+ * Check whether a datagram is one of our own broadcasts
+ * Args: broadcast address being ignored (cast to void *), source address
+ * of datagram and its length
+ * Returns: 1 if the datagram should be ignored, 0 otherwise
+ */
+static int ignore_udp(void *arg, struct sockaddr *src, socklen_t len)
+{
+    struct ignore_addr *igp = (struct ignore_addr *) arg;
+
+    /* Broadcast Interface: IPv4 */
+    return(igp->writers && memcmp((void *)src,(void *)&igp->iaddr,
+            (size_t) len) == 0);
+}
+
+ssize_t read_udp(iface_t *ifa, char *buf)
+{
+    struct if_udp *ifu = (struct if_udp *) ifa->info;
+
+    return(recv_msgs(ifu->fd,&ifu->rbatch,buf,
+            (ifu->ignore)?ignore_udp:NULL,ifu->ignore));
 }
 
 /* Check whether an address is multicast
@@ -342,7 +472,7 @@ struct iface *init_udp(struct iface *ifa)
     struct ignore_addr *igp;
     char debugbuf[INET6_ADDRSTRLEN];
     
-    if ((ifu=malloc(sizeof(struct if_udp))) == NULL) {
+    if ((ifu=calloc(1,sizeof(struct if_udp))) == NULL) {
         logerr(errno,"Could not allocate memory");
         return(NULL);
     }